@@ -0,0 +1,171 @@
+#include "connectioncache.h"
+#include "deliverylimits.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+
+ConnectionCache::ConnectionCache()
+{
+    connection_count = 0;
+    max_connection_count = 16;
+    connections = new CachedConnection [max_connection_count];
+
+    limits = 0;
+
+    idle_time = 30;
+    max_messages = 100;
+}
+
+ConnectionCache::~ConnectionCache()
+{
+    while (connection_count > 0)
+        Close(connection_count - 1);
+
+    delete [] connections;
+}
+
+void ConnectionCache::SetDeliveryLimits(DeliveryLimits *a_limits)
+{
+    limits = a_limits;
+}
+
+void ConnectionCache::SetPolicy(int an_idle_time, int a_max_messages)
+{
+    idle_time = an_idle_time;
+    max_messages = a_max_messages;
+}
+
+bool ConnectionCache::Put(
+    const char *address,
+    int sock_fd,
+    int message_count,
+    int capabilities
+)
+{
+    if (idle_time <= 0 || (max_messages > 0 && message_count >= max_messages))
+        return false;
+
+    if (connection_count == max_connection_count) {
+        max_connection_count *= 2;
+        CachedConnection *new_connections =
+            new CachedConnection [max_connection_count];
+        memcpy(
+            new_connections,
+            connections,
+            connection_count * sizeof(CachedConnection)
+        );
+        delete [] connections;
+        connections = new_connections;
+    }
+
+    CachedConnection *conn = &connections[connection_count++];
+    conn->address = strdup(address);
+    conn->sock_fd = sock_fd;
+    conn->message_count = message_count;
+    conn->capabilities = capabilities;
+    conn->idle_since = time(0);
+
+    return true;
+}
+
+int ConnectionCache::Take(
+    const char *address,
+    int &message_count,
+    int &capabilities
+)
+{
+    // the most recently used connection is the most likely to be alive
+    for (int i = connection_count - 1; i >= 0; i--) {
+        if (strcmp(connections[i].address, address))
+            continue;
+
+        int sock_fd = connections[i].sock_fd;
+        message_count = connections[i].message_count;
+        capabilities = connections[i].capabilities;
+
+        free((void*)connections[i].address);
+        connections[i] = connections[--connection_count];
+
+        return sock_fd;
+    }
+
+    return -1;
+}
+
+bool ConnectionCache::HasIdle(const char *address) const
+{
+    for (int i = 0; i < connection_count; i++) {
+        if (!strcmp(connections[i].address, address))
+            return true;
+    }
+    return false;
+}
+
+void ConnectionCache::GetFds(fd_set &read_fds, int &max_fd) const
+{
+    for (int i = 0; i < connection_count; i++) {
+        FD_SET(connections[i].sock_fd, &read_fds);
+        if (connections[i].sock_fd > max_fd)
+            max_fd = connections[i].sock_fd;
+    }
+}
+
+int ConnectionCache::HandleEvents(const fd_set &read_fds, time_t now)
+{
+    int closed = 0;
+    for (int i = connection_count - 1; i >= 0; i--) {
+        CachedConnection *conn = &connections[i];
+
+        if (now - conn->idle_since >= idle_time) {
+            // nobody waits for the reply to this
+            send(conn->sock_fd, "QUIT\r\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+            Close(i);
+            closed++;
+            continue;
+        }
+
+        if (!FD_ISSET(conn->sock_fd, &read_fds))
+            continue;
+
+        // an idle server only speaks to say goodbye (421) or closes
+        char c;
+        int len = recv(conn->sock_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (len >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            Close(i);
+            closed++;
+        }
+    }
+
+    return closed;
+}
+
+time_t ConnectionCache::GetNextExpiry() const
+{
+    time_t expiry = -1;
+    for (int i = 0; i < connection_count; i++) {
+        time_t t = connections[i].idle_since + idle_time;
+        if (expiry == -1 || t < expiry)
+            expiry = t;
+    }
+
+    return expiry;
+}
+
+
+
+void ConnectionCache::Close(int idx)
+{
+    CachedConnection *conn = &connections[idx];
+
+    shutdown(conn->sock_fd, 2);
+    close(conn->sock_fd);
+    if (limits)
+        limits->ReleaseAddress(conn->address);
+    free((void*)conn->address);
+
+    connections[idx] = connections[--connection_count];
+}
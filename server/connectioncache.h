@@ -0,0 +1,68 @@
+#ifndef CONNECTIONCACHE_H_SENTRY
+#define CONNECTIONCACHE_H_SENTRY
+
+#include <time.h>
+#include <sys/select.h>
+
+class DeliveryLimits;
+
+struct CachedConnection
+{
+    //Exchange address in dotted form
+    char *address;
+    int sock_fd;
+
+    //Transactions already done over the connection
+    int message_count;
+    //What the server announced in reply to EHLO
+    int capabilities;
+    time_t idle_since;
+};
+
+// Outbound connections left open after a transaction, keyed by the
+// exchange address. A connection keeps its address slot while it is
+// parked here, the next session for that address takes both over and
+// starts with RSET instead of a new handshake.
+class ConnectionCache
+{
+    CachedConnection *connections;
+    int connection_count, max_connection_count;
+
+    DeliveryLimits *limits;
+
+    int idle_time;
+    int max_messages;
+
+public:
+    ConnectionCache();
+    ~ConnectionCache();
+
+    void SetDeliveryLimits(DeliveryLimits *a_limits);
+    //Seconds a connection may stay idle and transactions it may
+    //carry, an idle time of 0 turns the cache off
+    void SetPolicy(int an_idle_time, int a_max_messages);
+
+    //Takes over the socket and its address slot, false if the
+    //connection is not worth keeping (the caller closes it then)
+    bool Put(
+        const char *address,
+        int sock_fd,
+        int message_count,
+        int capabilities
+    );
+    //Socket of an idle connection to the address, -1 if there is none
+    int Take(const char *address, int &message_count, int &capabilities);
+    bool HasIdle(const char *address) const;
+
+    void GetFds(fd_set &read_fds, int &max_fd) const;
+    //Closes the connections the server dropped and the expired ones,
+    //returns how many were closed
+    int HandleEvents(const fd_set &read_fds, time_t now);
+    //When the first connection expires, -1 if there are none
+    time_t GetNextExpiry() const;
+
+private:
+    void Close(int idx);
+};
+
+#endif
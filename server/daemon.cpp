@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <execinfo.h>
@@ -124,6 +125,8 @@ static int work_process()
     sigaction(SIGBUS, &sigact, 0);
 
     signal(SIGTERM, sigterm_handler);
+    // a peer dropping the connection shows up as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
 
     struct timespec timeout;
     timeout.tv_sec = 0;
@@ -277,6 +280,9 @@ int start_daemon(int argc, char **argv)
         return -1;
     }
 
+    //Buffered output must not be written twice by the children
+    fflush(stdout);
+
     //Creating child
     int pid = fork();
 
@@ -295,9 +301,21 @@ int start_daemon(int argc, char **argv)
             return 1;
         }
 
-        close(STDIN_FILENO);
-        close(STDOUT_FILENO);
-        close(STDERR_FILENO);
+        //Standard descriptors point to /dev/null rather than being
+        //closed, otherwise the next opened file (the queue journal)
+        //would take them and catch stray output
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO)
+                close(null_fd);
+        } else {
+            close(STDIN_FILENO);
+            close(STDOUT_FILENO);
+            close(STDERR_FILENO);
+        }
 
         status = monitor_process();
 
@@ -0,0 +1,142 @@
+#include "deliverylimits.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+DeliveryLimits::DeliveryLimits()
+{
+    memset(domains, 0, sizeof(domains));
+    memset(addresses, 0, sizeof(addresses));
+
+    max_per_domain = max_per_address = 0;
+    active_count = 0;
+}
+
+DeliveryLimits::~DeliveryLimits()
+{
+    Clear(domains);
+    Clear(addresses);
+}
+
+void DeliveryLimits::SetLimits(int a_max_per_domain, int a_max_per_address)
+{
+    max_per_domain = a_max_per_domain;
+    max_per_address = a_max_per_address;
+}
+
+bool DeliveryLimits::AcquireDomain(const char *domain)
+{
+    return AcquireDomain(domain, max_per_domain);
+}
+
+void DeliveryLimits::ReleaseDomain(const char *domain)
+{
+    Release(domains, domain);
+    active_count--;
+}
+
+bool DeliveryLimits::AcquireAddress(const char *address)
+{
+    return Acquire(addresses, address, max_per_address);
+}
+
+void DeliveryLimits::ReleaseAddress(const char *address)
+{
+    Release(addresses, address);
+}
+
+bool DeliveryLimits::AcquireDomain(const char *domain, int limit)
+{
+    if (!Acquire(domains, domain, limit))
+        return false;
+
+    active_count++;
+    return true;
+}
+
+bool DeliveryLimits::AcquireAddress(const char *address, int limit)
+{
+    return Acquire(addresses, address, limit);
+}
+
+int DeliveryLimits::GetAddressCount(const char *address) const
+{
+    Counter *counter = Find(addresses, address);
+    return counter ? counter->count: 0;
+}
+
+int DeliveryLimits::GetActiveCount() const { return active_count; }
+
+
+
+bool DeliveryLimits::Acquire(Counter **table, const char *name, int limit)
+{
+    Counter **bucket = &table[Hash(name)];
+
+    Counter *counter = *bucket;
+    while (counter && strcasecmp(counter->name, name))
+        counter = counter->next;
+
+    if (!counter) {
+        counter = new Counter;
+        counter->name = strdup(name);
+        counter->count = 0;
+        counter->next = *bucket;
+        *bucket = counter;
+    }
+
+    if (limit > 0 && counter->count >= limit)
+        return false;
+
+    counter->count++;
+    return true;
+}
+
+DeliveryLimits::Counter* DeliveryLimits::Find(
+    Counter *const *table,
+    const char *name
+)
+{
+    Counter *counter = table[Hash(name)];
+    while (counter && strcasecmp(counter->name, name))
+        counter = counter->next;
+    return counter;
+}
+
+void DeliveryLimits::Release(Counter **table, const char *name)
+{
+    Counter **link = &table[Hash(name)];
+    while (*link && strcasecmp((*link)->name, name))
+        link = &(*link)->next;
+
+    Counter *counter = *link;
+    if (!counter)
+        return;
+
+    // only destinations in use are kept
+    if (--counter->count <= 0) {
+        *link = counter->next;
+        free((void*)counter->name);
+        delete counter;
+    }
+}
+
+void DeliveryLimits::Clear(Counter **table)
+{
+    for (int i = 0; i < K_BUCKET_COUNT; i++) {
+        while (table[i]) {
+            Counter *counter = table[i];
+            table[i] = counter->next;
+            free((void*)counter->name);
+            delete counter;
+        }
+    }
+}
+
+unsigned int DeliveryLimits::Hash(const char *name)
+{
+    // domains compare without case
+    return hash_string_nocase(name) % K_BUCKET_COUNT;
+}
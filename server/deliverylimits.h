@@ -0,0 +1,57 @@
+#ifndef DELIVERYLIMITS_H_SENTRY
+#define DELIVERYLIMITS_H_SENTRY
+
+// Counts the outbound connections open to every destination domain
+// and every exchange address. A slot is taken before the lookup
+// (domain) and before the connect (address), sessions that get none
+// wait without holding anything else.
+class DeliveryLimits
+{
+    struct Counter
+    {
+        char *name;
+        int count;
+        Counter *next;
+    };
+
+    enum {
+        K_BUCKET_COUNT = 256
+    };
+
+    Counter *domains[K_BUCKET_COUNT];
+    Counter *addresses[K_BUCKET_COUNT];
+
+    int max_per_domain, max_per_address;
+    int active_count;
+
+public:
+    DeliveryLimits();
+    ~DeliveryLimits();
+
+    //0 for no limit
+    void SetLimits(int a_max_per_domain, int a_max_per_address);
+
+    //False if the destination is at its limit
+    bool AcquireDomain(const char *domain);
+    void ReleaseDomain(const char *domain);
+    bool AcquireAddress(const char *address);
+    void ReleaseAddress(const char *address);
+    //The same with a limit of their own, for the relay hosts
+    bool AcquireDomain(const char *domain, int limit);
+    bool AcquireAddress(const char *address, int limit);
+
+    //Slots the address holds, parked connections included
+    int GetAddressCount(const char *address) const;
+
+    //Domain slots held, i.e. transactions past the waiting stage
+    int GetActiveCount() const;
+
+private:
+    static bool Acquire(Counter **table, const char *name, int limit);
+    static Counter* Find(Counter *const *table, const char *name);
+    static void Release(Counter **table, const char *name);
+    static void Clear(Counter **table);
+    static unsigned int Hash(const char *name);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "destinationhealth.h"
+#include "hash.h"
+#include "daemon.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+DestinationHealth::DestinationHealth()
+{
+    memset(destinations, 0, sizeof(destinations));
+
+    max_failures = 5;
+    open_time = 300;
+}
+
+DestinationHealth::~DestinationHealth()
+{
+    for (int i = 0; i < K_BUCKET_COUNT; i++) {
+        while (destinations[i]) {
+            DestinationState *dest = destinations[i];
+            destinations[i] = dest->next;
+            Free(dest);
+        }
+    }
+}
+
+void DestinationHealth::SetPolicy(int a_max_failures, int an_open_time)
+{
+    max_failures = a_max_failures;
+    open_time = an_open_time;
+}
+
+bool DestinationHealth::IsOpen(const char *name, time_t now) const
+{
+    DestinationState *dest = Find(name);
+    return dest && now < dest->open_until;
+}
+
+const char* DestinationHealth::GetLastError(const char *name) const
+{
+    DestinationState *dest = Find(name);
+    return dest ? dest->last_error: 0;
+}
+
+void DestinationHealth::Success(const char *name, long latency_ms)
+{
+    // the common case, nothing is known and nothing is kept
+    DestinationState **link = &destinations[Hash(name)];
+    while (*link && strcasecmp((*link)->name, name))
+        link = &(*link)->next;
+    DestinationState *dest = *link;
+    if (!dest)
+        return;
+
+    if (max_failures > 0 && dest->failures >= max_failures) {
+        write_log(
+            "[SMTP-DAEMON] Destination %s answers again, connect took %ld ms\n",
+            name,
+            latency_ms
+        );
+    }
+
+    *link = dest->next;
+    Free(dest);
+}
+
+void DestinationHealth::Failure(
+    const char *name,
+    const char *error,
+    time_t now
+)
+{
+    DestinationState *dest = Get(name, now);
+
+    dest->failures++;
+    dest->last_failure = now;
+    if (dest->last_error)
+        free((void*)dest->last_error);
+    dest->last_error = strdup(error);
+
+    if (max_failures <= 0 || dest->failures < max_failures)
+        return;
+
+    dest->open_until = now + open_time;
+    write_log(
+        "[SMTP-DAEMON] Destination %s failed %d times in a row (%s), "
+        "skipped for %d seconds\n",
+        name,
+        dest->failures,
+        error,
+        open_time
+    );
+}
+
+
+
+DestinationState* DestinationHealth::Find(const char *name) const
+{
+    DestinationState *dest = destinations[Hash(name)];
+    while (dest && strcasecmp(dest->name, name))
+        dest = dest->next;
+    return dest;
+}
+
+DestinationState* DestinationHealth::Get(const char *name, time_t now)
+{
+    DestinationState *dest = Find(name);
+    if (dest)
+        return dest;
+
+    // destinations nobody tried for a long time are forgotten, one
+    // bucket at a time as new ones come in
+    unsigned int bucket = Hash(name);
+    DestinationState **link = &destinations[bucket];
+    while (*link) {
+        DestinationState *old = *link;
+        if (now < old->open_until || now - old->last_failure < K_FORGET_TIME) {
+            link = &old->next;
+            continue;
+        }
+        *link = old->next;
+        Free(old);
+    }
+
+    dest = new DestinationState;
+    dest->name = strdup(name);
+    dest->failures = 0;
+    dest->last_failure = now;
+    dest->last_error = 0;
+    dest->open_until = 0;
+    dest->next = destinations[bucket];
+    destinations[bucket] = dest;
+    return dest;
+}
+
+void DestinationHealth::Free(DestinationState *dest)
+{
+    free((void*)dest->name);
+    if (dest->last_error)
+        free((void*)dest->last_error);
+    delete dest;
+}
+
+unsigned int DestinationHealth::Hash(const char *name)
+{
+    // domains compare without case
+    return hash_string_nocase(name) % K_BUCKET_COUNT;
+}
@@ -0,0 +1,63 @@
+#ifndef DESTINATIONHEALTH_H_SENTRY
+#define DESTINATIONHEALTH_H_SENTRY
+
+#include <time.h>
+
+struct DestinationState
+{
+    //Domain name or exchange address in dotted form
+    char *name;
+
+    int failures;
+    time_t last_failure;
+    char *last_error;
+    //Attempts are skipped until then once the failures pile up
+    time_t open_until;
+
+    DestinationState *next;
+};
+
+// Destinations that failed to answer, domains and exchange addresses
+// alike. A destination that failed too many times in a row is skipped
+// for a while; after that the sessions go through again and the first
+// of them to get an answer closes the circuit, while one more failure
+// opens it right away. Only failing destinations have an entry, an
+// answer drops it, and so does a day without news.
+class DestinationHealth
+{
+    enum {
+        K_BUCKET_COUNT = 256,
+        K_FORGET_TIME = 86400
+    };
+
+    DestinationState *destinations[K_BUCKET_COUNT];
+
+    int max_failures;
+    int open_time;
+
+public:
+    DestinationHealth();
+    ~DestinationHealth();
+
+    //Failures in a row that open the circuit and for how many
+    //seconds, no failure count opens it if max_failures is 0
+    void SetPolicy(int a_max_failures, int an_open_time);
+
+    //True while attempts to the destination are skipped
+    bool IsOpen(const char *name, time_t now) const;
+    //Error of the last failure, 0 if there was none
+    const char* GetLastError(const char *name) const;
+
+    //latency_ms is only logged, when a circuit closes
+    void Success(const char *name, long latency_ms);
+    void Failure(const char *name, const char *error, time_t now);
+
+private:
+    DestinationState* Find(const char *name) const;
+    //Adds the destination if it is not known yet
+    DestinationState* Get(const char *name, time_t now);
+    static void Free(DestinationState *dest);
+    static unsigned int Hash(const char *name);
+};
+
+#endif
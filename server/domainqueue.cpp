@@ -0,0 +1,128 @@
+#include "domainqueue.h"
+#include "hash.h"
+#include "smtpclient.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+DomainQueue::DomainQueue()
+{
+    memset(domains, 0, sizeof(domains));
+    count = 0;
+}
+
+DomainQueue::~DomainQueue()
+{
+    for (int i = 0; i < K_BUCKET_COUNT; i++) {
+        while (domains[i])
+            DropDomain(&domains[i]);
+    }
+}
+
+void DomainQueue::Push(SMTPClientSession *session)
+{
+    const char *name = session->GetDomain();
+    Domain **link = FindDomain(name);
+
+    Domain *domain = *link;
+    if (!domain) {
+        domain = new Domain;
+        domain->name = strdup(name);
+        domain->head = domain->tail = 0;
+        domain->next = domains[Hash(name)];
+        domains[Hash(name)] = domain;
+    }
+
+    Waiter *waiter = new Waiter;
+    waiter->session = session;
+    waiter->next = 0;
+    if (domain->tail)
+        domain->tail->next = waiter;
+    else
+        domain->head = waiter;
+    domain->tail = waiter;
+
+    count++;
+}
+
+SMTPClientSession* DomainQueue::Claim(const char *name)
+{
+    Domain **link = FindDomain(name);
+    Domain *domain = *link;
+    if (!domain)
+        return 0;
+
+    Waiter *waiter = domain->head;
+    SMTPClientSession *session = waiter->session;
+    domain->head = waiter->next;
+    delete waiter;
+    count--;
+
+    // only domains somebody waits for are kept
+    if (!domain->head)
+        DropDomain(link);
+
+    return session;
+}
+
+void DomainQueue::Remove(SMTPClientSession *session)
+{
+    Domain **link = FindDomain(session->GetDomain());
+    Domain *domain = *link;
+    if (!domain)
+        return;
+
+    Waiter *prev = 0;
+    Waiter *waiter = domain->head;
+    while (waiter && waiter->session != session) {
+        prev = waiter;
+        waiter = waiter->next;
+    }
+    if (!waiter)
+        return;
+
+    if (prev)
+        prev->next = waiter->next;
+    else
+        domain->head = waiter->next;
+    if (domain->tail == waiter)
+        domain->tail = prev;
+    delete waiter;
+    count--;
+
+    if (!domain->head)
+        DropDomain(link);
+}
+
+int DomainQueue::GetCount() const { return count; }
+
+
+
+DomainQueue::Domain** DomainQueue::FindDomain(const char *name)
+{
+    Domain **link = &domains[Hash(name)];
+    while (*link && strcasecmp((*link)->name, name))
+        link = &(*link)->next;
+    return link;
+}
+
+void DomainQueue::DropDomain(Domain **link)
+{
+    Domain *domain = *link;
+    *link = domain->next;
+
+    while (domain->head) {
+        Waiter *waiter = domain->head;
+        domain->head = waiter->next;
+        delete waiter;
+    }
+    free((void*)domain->name);
+    delete domain;
+}
+
+unsigned int DomainQueue::Hash(const char *name)
+{
+    // domains compare without case
+    return hash_string_nocase(name) % K_BUCKET_COUNT;
+}
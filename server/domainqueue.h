@@ -0,0 +1,53 @@
+#ifndef DOMAINQUEUE_H_SENTRY
+#define DOMAINQUEUE_H_SENTRY
+
+class SMTPClientSession;
+
+// Sessions that found their destination domain at its connection
+// limit, kept in arrival order per domain. A session that gives up its
+// domain slot wakes the first one waiting for the same domain, and a
+// session that ends a transaction cleanly hands it the connection
+// itself, so a burst to one domain goes out as a batch over the
+// connections already open.
+class DomainQueue
+{
+    struct Waiter
+    {
+        SMTPClientSession *session;
+        Waiter *next;
+    };
+
+    struct Domain
+    {
+        char *name;
+        Waiter *head, *tail;
+        Domain *next;
+    };
+
+    enum {
+        K_BUCKET_COUNT = 256
+    };
+
+    Domain *domains[K_BUCKET_COUNT];
+    int count;
+
+public:
+    DomainQueue();
+    ~DomainQueue();
+
+    //Queued under the domain of the session
+    void Push(SMTPClientSession *session);
+    //Takes the session waiting longest for the domain, 0 if none is
+    SMTPClientSession* Claim(const char *domain);
+    //Takes the session out wherever it is in the queue
+    void Remove(SMTPClientSession *session);
+
+    int GetCount() const;
+
+private:
+    Domain** FindDomain(const char *name);
+    void DropDomain(Domain **link);
+    static unsigned int Hash(const char *name);
+};
+
+#endif
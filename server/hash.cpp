@@ -0,0 +1,34 @@
+#include "hash.h"
+
+#include <ctype.h>
+
+static const unsigned int k_hash_prime = 16777619u;
+
+unsigned int hash_data(unsigned int hash, const void *data, int len)
+{
+    for (int i = 0; i < len; i++) {
+        hash ^= ((const unsigned char*)data)[i];
+        hash *= k_hash_prime;
+    }
+    return hash;
+}
+
+unsigned int hash_string(const char *str)
+{
+    unsigned int hash = k_hash_basis;
+    for (const char *p = str; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= k_hash_prime;
+    }
+    return hash;
+}
+
+unsigned int hash_string_nocase(const char *str)
+{
+    unsigned int hash = k_hash_basis;
+    for (const char *p = str; *p; p++) {
+        hash ^= (unsigned char)tolower((unsigned char)*p);
+        hash *= k_hash_prime;
+    }
+    return hash;
+}
@@ -0,0 +1,15 @@
+#ifndef HASH_H_SENTRY
+#define HASH_H_SENTRY
+
+// FNV-1a, what the in-memory tables bucket by and what the spool and
+// journal records are checked with, so its values must not change.
+
+static const unsigned int k_hash_basis = 2166136261u;
+
+//Goes on from hash over len more bytes
+unsigned int hash_data(unsigned int hash, const void *data, int len);
+unsigned int hash_string(const char *str);
+//ASCII letters are folded, for names that compare without case
+unsigned int hash_string_nocase(const char *str);
+
+#endif
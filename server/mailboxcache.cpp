@@ -0,0 +1,144 @@
+#include "mailboxcache.h"
+#include "hash.h"
+#include "writeall.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+MailboxCache::MailboxCache()
+{
+    memset(buckets, 0, sizeof(buckets));
+    head = tail = 0;
+    count = 0;
+    max_count = 64;
+}
+
+MailboxCache::~MailboxCache()
+{
+    while (head)
+        Close(head);
+}
+
+void MailboxCache::SetMaxCount(int a_max_count)
+{
+    max_count = a_max_count;
+    while (count > 0 && count > max_count)
+        Close(tail);
+}
+
+int MailboxCache::Append(const char *path, const iovec *iov, int iov_count)
+{
+    OpenMailbox *box = Open(path);
+    if (!box)
+        return -1;
+
+    if (flock(box->fd, LOCK_EX) < 0) {
+        Close(box);
+        return -1;
+    }
+
+    // a reader that replaced the mailbox leaves the kept descriptor
+    // pointing at the removed file
+    struct stat st;
+    if (fstat(box->fd, &st) < 0 || st.st_nlink == 0) {
+        Close(box);
+        box = Open(path);
+        if (!box)
+            return -1;
+        if (flock(box->fd, LOCK_EX) < 0) {
+            Close(box);
+            return -1;
+        }
+    }
+
+    int status = write_all(box->fd, iov, iov_count);
+    flock(box->fd, LOCK_UN);
+
+    if (status < 0 || max_count <= 0)
+        Close(box);
+
+    return status;
+}
+
+
+
+OpenMailbox* MailboxCache::Open(const char *path)
+{
+    unsigned int bucket = Hash(path);
+    OpenMailbox *box = buckets[bucket];
+    while (box && strcmp(box->path, path))
+        box = box->hash_next;
+
+    if (box) {
+        Unlink(box);
+        LinkFirst(box);
+        return box;
+    }
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (fd < 0)
+        return 0;
+
+    if (max_count > 0 && count >= max_count)
+        Close(tail);
+
+    box = new OpenMailbox;
+    box->path = strdup(path);
+    box->fd = fd;
+    box->hash_next = buckets[bucket];
+    buckets[bucket] = box;
+    LinkFirst(box);
+    count++;
+
+    return box;
+}
+
+void MailboxCache::Close(OpenMailbox *box)
+{
+    OpenMailbox **link = &buckets[Hash(box->path)];
+    while (*link != box)
+        link = &(*link)->hash_next;
+    *link = box->hash_next;
+
+    Unlink(box);
+    count--;
+
+    close(box->fd);
+    free((void*)box->path);
+    delete box;
+}
+
+void MailboxCache::Unlink(OpenMailbox *box)
+{
+    if (box->prev)
+        box->prev->next = box->next;
+    else
+        head = box->next;
+    if (box->next)
+        box->next->prev = box->prev;
+    else
+        tail = box->prev;
+    box->prev = box->next = 0;
+}
+
+void MailboxCache::LinkFirst(OpenMailbox *box)
+{
+    box->prev = 0;
+    box->next = head;
+    if (head)
+        head->prev = box;
+    else
+        tail = box;
+    head = box;
+}
+
+unsigned int MailboxCache::Hash(const char *path)
+{
+    return hash_string(path) % K_BUCKET_COUNT;
+}
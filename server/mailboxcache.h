@@ -0,0 +1,49 @@
+#ifndef MAILBOXCACHE_H_SENTRY
+#define MAILBOXCACHE_H_SENTRY
+
+#include <sys/uio.h>
+
+struct OpenMailbox
+{
+    char *path;
+    int fd;
+
+    OpenMailbox *hash_next;
+    //Use order, the most recently used first
+    OpenMailbox *prev, *next;
+};
+
+// Local mailboxes kept open between deliveries, up to a limit, the
+// least recently used one is closed to make room. Every record goes
+// in under an exclusive flock() so readers that lock the mailbox
+// never see half of it, and the whole record is one writev().
+class MailboxCache
+{
+    enum {
+        K_BUCKET_COUNT = 256
+    };
+
+    OpenMailbox *buckets[K_BUCKET_COUNT];
+    OpenMailbox *head, *tail;
+    int count, max_count;
+
+public:
+    MailboxCache();
+    ~MailboxCache();
+
+    //Mailboxes kept open, 0 closes each one after its record
+    void SetMaxCount(int a_max_count);
+
+    //Appends the pieces as one record, -1 on failure
+    int Append(const char *path, const iovec *iov, int iov_count);
+
+private:
+    OpenMailbox* Open(const char *path);
+    void Close(OpenMailbox *box);
+
+    void Unlink(OpenMailbox *box);
+    void LinkFirst(OpenMailbox *box);
+    static unsigned int Hash(const char *path);
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "maildir.h"
+#include "writeall.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+int MaildirDelivery::sequence = 0;
+
+MaildirDelivery::MaildirDelivery(const char *a_host)
+{
+    host = a_host;
+    tmp_path = 0;
+}
+
+MaildirDelivery::~MaildirDelivery()
+{
+    if (tmp_path) {
+        unlink(tmp_path);
+        delete [] tmp_path;
+    }
+}
+
+int MaildirDelivery::Deliver(
+    const char *maildir,
+    const iovec *iov,
+    int iov_count
+)
+{
+    if (!tmp_path) {
+        tmp_path = WriteCopy(maildir, iov, iov_count);
+        if (!tmp_path)
+            return -1;
+    }
+
+    char *new_path = MakePath(maildir, "new");
+    int status = link(tmp_path, new_path);
+    if (status < 0 && errno == ENOENT && Prepare(maildir) == 0)
+        status = link(tmp_path, new_path);
+
+    if (status < 0 && errno == EXDEV) {
+        // no links across file systems, the Maildir gets its own copy
+        char *copy_path = WriteCopy(maildir, iov, iov_count);
+        status = copy_path ? rename(copy_path, new_path): -1;
+        if (copy_path) {
+            if (status < 0)
+                unlink(copy_path);
+            delete [] copy_path;
+        }
+    }
+
+    delete [] new_path;
+
+    // the recipient counts as delivered once this returns, so the new
+    // name has to be on the disk as well
+    if (status == 0)
+        status = SyncDir(maildir, "new");
+
+    return status < 0 ? -1: 0;
+}
+
+
+
+int MaildirDelivery::Prepare(const char *maildir)
+{
+    static const char *subdirs[] = { "", "/tmp", "/new", "/cur" };
+
+    char *path = new char [strlen(maildir) + 8];
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "%s%s", maildir, subdirs[i]);
+        if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+            delete [] path;
+            return -1;
+        }
+    }
+    delete [] path;
+
+    return 0;
+}
+
+int MaildirDelivery::SyncDir(const char *maildir, const char *subdir)
+{
+    char *path = new char [strlen(maildir) + strlen(subdir) + 2];
+    sprintf(path, "%s/%s", maildir, subdir);
+    int fd = open(path, O_RDONLY);
+    delete [] path;
+    if (fd < 0)
+        return -1;
+
+    int status = fsync(fd);
+    close(fd);
+
+    return status;
+}
+
+char* MaildirDelivery::WriteCopy(
+    const char *maildir,
+    const iovec *iov,
+    int iov_count
+)
+{
+    char *path = MakePath(maildir, "tmp");
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    // a Maildir is only made on its first delivery
+    if (fd < 0 && errno == ENOENT && Prepare(maildir) == 0)
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        delete [] path;
+        return 0;
+    }
+
+    // the links only get a name once the data is on the disk
+    int status = write_all(fd, iov, iov_count);
+    if (!status && fsync(fd) < 0)
+        status = -1;
+    if (close(fd) < 0)
+        status = -1;
+
+    if (status < 0) {
+        unlink(path);
+        delete [] path;
+        return 0;
+    }
+
+    return path;
+}
+
+char* MaildirDelivery::MakePath(const char *maildir, const char *subdir)
+{
+    timeval now;
+    gettimeofday(&now, 0);
+
+    // time.M<usec>P<pid>Q<sequence>.host as Maildir readers expect
+    char *path = new char [strlen(maildir) + strlen(host) + 80];
+    sprintf(
+        path,
+        "%s/%s/%ld.M%ldP%dQ%d.%s",
+        maildir,
+        subdir,
+        (long)now.tv_sec,
+        (long)now.tv_usec,
+        (int)getpid(),
+        ++sequence,
+        host
+    );
+    return path;
+}
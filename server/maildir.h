@@ -0,0 +1,40 @@
+#ifndef MAILDIR_H_SENTRY
+#define MAILDIR_H_SENTRY
+
+#include <sys/uio.h>
+
+// Delivers one message into the Maildirs of its local recipients. The
+// message is written and synced once, into tmp/ of the first Maildir,
+// every recipient gets a hard link to it in new/ and the tmp/ name is
+// removed at the end, new/ is synced before a recipient counts as
+// delivered. A Maildir on another file system gets a copy of its own.
+// Names are unique per process and call, so any number of writers can
+// deliver into the same Maildir.
+class MaildirDelivery
+{
+    const char *host;
+
+    //The copy in tmp/ the links are made from, 0 until written
+    char *tmp_path;
+
+    static int sequence;
+
+public:
+    MaildirDelivery(const char *a_host);
+    //Removes the tmp/ name, the links stay
+    ~MaildirDelivery();
+
+    //The data is only written on the first call, -1 on failure
+    int Deliver(const char *maildir, const iovec *iov, int iov_count);
+
+private:
+    //Creates the Maildir, called when one of its directories is missing
+    static int Prepare(const char *maildir);
+    static int SyncDir(const char *maildir, const char *subdir);
+    //tmp/ file of the Maildir written and synced, its path (new[]'ed)
+    //or 0 on failure
+    char* WriteCopy(const char *maildir, const iovec *iov, int iov_count);
+    char* MakePath(const char *maildir, const char *subdir);
+};
+
+#endif
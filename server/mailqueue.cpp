@@ -1,15 +1,24 @@
 #include "mailqueue.h"
+#include "hash.h"
+#include "writeall.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
        
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -17,13 +26,178 @@
 #include "daemon.h"
 #include "options.h"
 #include "resolve.h"
+#include "queuerecovery.h"
+
+// Spool record layout:
+//   SpoolFileHeader
+//   SpoolFileRecipient[recipients_count]
+//   id, sender and recipient addresses, each '\0' terminated
+//   message data, body_offset/body_length
+// Everything is fixed width and in host order, so a mapped record is
+// used as it is. The checksum covers all bytes in front of the data
+// except the recipient states, which are rewritten in place.
+
+#pragma pack(push, 1)
+struct SpoolFileHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t recipients_count;
+    uint32_t id_length;
+    uint32_t sender_length;
+    uint32_t checksum;
+    int64_t create_time;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint32_t flags;
+    uint8_t reserved[12];
+};
+
+struct SpoolFileRecipientState
+{
+    uint8_t status;
+    uint8_t reserved[3];
+    uint32_t attempts;
+    int64_t last_attempt;
+    int64_t next_attempt;
+};
+
+// 32 bytes at 32 byte aligned offsets, so rewriting the state of one
+// recipient never straddles a disk sector
+struct SpoolFileRecipient
+{
+    uint32_t address_offset;
+    uint16_t address_length;
+    uint16_t reserved;
+    SpoolFileRecipientState state;
+};
+#pragma pack(pop)
+
+static const char k_spool_magic[4] = {'S', 'P', 'L', '2'};
+static const int k_spool_version = 1;
+
+// sessions waiting for a destination slot take no connection, but
+// their number is still bounded by this many times max_deliveries
+static const int k_max_waiting_factor = 4;
+
+enum {
+    //Set once the data is stored CRLF terminated and dot-stuffed
+    spool_flag_wire_data = 0x1
+};
+
+static long spool_strings_offset(const SpoolFileHeader *header)
+{
+    return header->header_size +
+        header->recipients_count * sizeof(SpoolFileRecipient);
+}
+
+static unsigned int spool_checksum(const char *record)
+{
+    SpoolFileHeader header;
+    memcpy(&header, record, sizeof(header));
+    header.checksum = 0;
+
+    unsigned int hash = hash_data(k_hash_basis, &header, sizeof(header));
+
+    const SpoolFileRecipient *table =
+        (const SpoolFileRecipient*)(record + header.header_size);
+    for (unsigned int i = 0; i < header.recipients_count; i++) {
+        hash = hash_data(hash, &table[i].address_offset, 4);
+        hash = hash_data(hash, &table[i].address_length, 2);
+    }
+
+    long strings_offset = spool_strings_offset(&header);
+    return hash_data(
+        hash,
+        record + strings_offset,
+        header.body_offset - strings_offset
+    );
+}
+
+// Checks everything in front of the data, record holds the first
+// `available` bytes of a file of `file_size` bytes
+static bool check_spool_envelope(
+    const char *record,
+    long available,
+    long file_size
+)
+{
+    const SpoolFileHeader *header = (const SpoolFileHeader*)record;
+
+    if (available < (long)sizeof(*header) ||
+        memcmp(header->magic, k_spool_magic, sizeof(header->magic)) ||
+        header->version != k_spool_version ||
+        header->header_size != sizeof(*header) ||
+        header->recipients_count > file_size / sizeof(SpoolFileRecipient))
+        return false;
+
+    uint64_t strings_offset = spool_strings_offset(header);
+    if (header->body_offset < strings_offset ||
+        header->body_offset > (uint64_t)available ||
+        header->body_offset + header->body_length != (uint64_t)file_size ||
+        (uint64_t)header->id_length + header->sender_length + 2 >
+            header->body_offset - strings_offset)
+        return false;
+
+    if (spool_checksum(record) != header->checksum)
+        return false;
+
+    const char *record_id = record + strings_offset;
+    if (record_id[header->id_length] != '\0' ||
+        record_id[header->id_length + 1 + header->sender_length] != '\0')
+        return false;
+
+    const SpoolFileRecipient *table =
+        (const SpoolFileRecipient*)(record + header->header_size);
+    for (unsigned int i = 0; i < header->recipients_count; i++) {
+        uint64_t end = (uint64_t)table[i].address_offset +
+            table[i].address_length;
+        if (table[i].address_offset < strings_offset ||
+            end >= header->body_offset || record[end] != '\0')
+            return false;
+    }
+
+    return true;
+}
+
+// a checkpoint time, which tells it from a path of the first format
+static bool is_number(const char *str)
+{
+    if (*str == '-')
+        str++;
+    if (!*str)
+        return false;
+    for (; *str; str++) {
+        if (*str < '0' || *str > '9')
+            return false;
+    }
+    return true;
+}
+
+// the smaller of the timeout (ms, -1 for none) and the time until when
+static long merge_timeout(long timeout, time_t when)
+{
+    if (when == (time_t)-1)
+        return timeout;
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    long until = 0;
+    if (when > now.tv_sec)
+        until = (when - now.tv_sec) * 1000 - now.tv_usec / 1000;
+
+    return (timeout < 0 || until < timeout) ? until: timeout;
+}
 
 Message::Message(
     const char *an_id, 
     const char *a_sender_address,
     char **a_recipients_address,
     int a_recipients_count,
-    const InoutBuffer *a_data
+    const char *a_data,
+    int a_data_length
 ) 
 {
     id = strdup(an_id);
@@ -33,23 +207,27 @@ Message::Message(
     sender_address = strdup(a_sender_address);
     recipients_count = a_recipients_count;
     recipients_address = new char* [recipients_count];
-    for (int i = 0; i < recipients_count; i++) 
+    recipients_state = new RecipientState [recipients_count];
+    for (int i = 0; i < recipients_count; i++) {
         recipients_address[i] = strdup(a_recipients_address[i]);
-    data.AddData(a_data->GetBuffer(), a_data->Length());
+        memset(&recipients_state[i], 0, sizeof(RecipientState));
+    }
+    data.AddData(a_data, a_data_length);
+    data_map = 0;
+    data_map_length = 0;
+    mapped_data = 0;
 
+    // nothing is written here, see WriteTempSpoolFile/GenerateSpoolFile
+    spool_path = GenerateSpoolPath();
+    mime_path = GenerateMimePath(spool_path);
 
-    data_path = GenerateDataPath();
-    info_path = GenerateInfoPath();
-    
-    //Check for creation!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-    GenerateDataFile();    
-    GenerateInfoFile();
+    body_offset = -1;
+    body_length = 0;
 }
 
 Message::Message(
     const char *an_id, 
-    const char *an_info_path, 
-    const char *a_data_path,
+    const char *a_spool_path,
     time_t a_create_time
 ) 
 {
@@ -58,10 +236,19 @@ Message::Message(
     
     sender_address = 0;
     recipients_address = 0;
+    recipients_state = 0;
     recipients_count = 0;
 
-    info_path = strdup(an_info_path);
-    data_path = strdup(a_data_path);
+    data_map = 0;
+    data_map_length = 0;
+    mapped_data = 0;
+
+    spool_path = new char [strlen(a_spool_path) + 1];
+    strcpy(spool_path, a_spool_path);
+    mime_path = GenerateMimePath(spool_path);
+
+    body_offset = -1;
+    body_length = 0;
 }
 
 Message::~Message() 
@@ -78,18 +265,24 @@ Message::~Message()
                 free((void*)recipients_address[i]);
         delete [] recipients_address;
     }
+    if (recipients_state)
+        delete [] recipients_state;
 
-    if (info_path)
-        delete [] info_path;
-    if (data_path)
-        delete [] data_path;
+    ClearData();
+
+    if (spool_path)
+        delete [] spool_path;
+    if (mime_path)
+        delete [] mime_path;
 }
 
 
 
 int Message::DeleteMessage() 
 {
-    return remove(data_path) & remove(info_path);
+    // the sidecar is optional, a missing one is not an error
+    remove(mime_path);
+    return remove(spool_path);
 }
 
 
@@ -102,11 +295,65 @@ int Message::GetRecipientsCount() const { return recipients_count; }
 
 char** Message::GetRecipientsAddress() { return recipients_address; }
 
-const InoutBuffer* Message::GetData() const { return &data; }
+int Message::GetRecipientStatus(int idx) const 
+{
+    return recipients_state[idx].status;
+}
+
+const RecipientState* Message::GetRecipientState(int idx) const
+{
+    return &recipients_state[idx];
+}
+
+int Message::GetPendingRecipientsCount() const
+{
+    int count = 0;
+    for (int i = 0; i < recipients_count; i++) {
+        if (recipients_state[i].status == rcpt_pending)
+            count++;
+    }
+    return count;
+}
+
+bool Message::IsRecipientDue(int idx, time_t now) const
+{
+    return recipients_state[idx].status == rcpt_pending &&
+        recipients_state[idx].next_attempt <= now;
+}
+
+time_t Message::GetNextAttempt() const
+{
+    time_t next_attempt = 0;
+    for (int i = 0; i < recipients_count; i++) {
+        if (recipients_state[i].status != rcpt_pending)
+            continue;
+
+        time_t when = recipients_state[i].next_attempt;
+        if (!when)
+            return 0;
+        if (!next_attempt || when < next_attempt)
+            next_attempt = when;
+    }
+    return next_attempt;
+}
+
+const char* Message::GetData() const 
+{
+    return mapped_data ? mapped_data: data.GetBuffer();
+}
+
+int Message::GetDataLength() const
+{
+    return mapped_data ? body_length: data.Length();
+}
+
+long Message::GetBodyOffset() const { return body_offset; }
+
+int Message::GetBodyLength() const { return body_length; }
 
-const char* Message::GetDataPath() const { return data_path; }
+const char* Message::GetSpoolPath() const { return spool_path; }
 
-const char* Message::GetInfoPath() const { return info_path; }
+const char* Message::GetMimePath() const { return mime_path; }
 
 time_t Message::GetCreateTime() const { return create_time; }
 
@@ -118,7 +365,7 @@ bool Message::IsInfoLoaded() const
 
 bool Message::IsDataLoadad() const 
 {
-    return data.Length() != 0;
+    return (mapped_data != 0) || (data.Length() != 0);
 }
 
     
@@ -172,244 +419,781 @@ int Message::FindAtSymbolInAddress(const char *address)
     return at_count == 1 ? res_pos: -1;
 }
 
+void Message::MakeWireData(const char *src, int len, InoutBuffer &wire)
+{
+    // whole lines are copied at once, only the line ends are rewritten
+    const char *p = src, *end = src + len;
+    while (p < end) {
+        if (*p == '.')
+            wire.AddChar('.');
+
+        const char *nl = (const char*)memchr(p, '\n', end - p);
+        if (!nl) {
+            wire.AddData(p, end - p);
+            wire.AddData("\r\n", 2);
+            break;
+        }
+
+        int line_len = nl - p;
+        if (line_len && nl[-1] == '\r')
+            line_len--;
+        wire.AddData(p, line_len);
+        wire.AddData("\r\n", 2);
+
+        p = nl + 1;
+    }
+}
+
+void Message::MakeMailboxData(const char *src, int len, InoutBuffer &box)
+{
+    const char *p = src, *end = src + len;
+    while (p < end) {
+        if (*p == '.')
+            p++;
+
+        const char *nl = (const char*)memchr(p, '\n', end - p);
+        int line_len = nl ? nl - p: end - p;
+        if (line_len && p[line_len - 1] == '\r')
+            line_len--;
+        box.AddData(p, line_len);
+        box.AddChar('\n');
+
+        p = nl ? nl + 1: end;
+    }
+}
+
 
 
 int Message::ReadInfoFile() 
 {
-    FILE *f_info = fopen(info_path, "r");
-    if (f_info == NULL)
+    int fd = open(spool_path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < 4) {
+        close(fd);
+        return -1;
+    }
+
+    char *record = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (record == MAP_FAILED)
         return -1;
     
     ClearInfo();
 
-    int len;
-    sender_address = ReadLineFromFile(f_info, len);
-    fscanf(f_info, "%d\n", &recipients_count);
-    
-    recipients_address = new char* [recipients_count];
-    for (int i = 0; i < recipients_count; i++)
-        recipients_address[i] = ReadLineFromFile(f_info, len);
-    
-    fclose(f_info);
-    return 0;
+    int status = ParseSpoolRecord(record, st.st_size);
+    munmap(record, st.st_size);
+
+    return status;
 }
 
 int Message::ReadDataFile()
 { 
-    FILE *f_data = fopen(data_path, "r");
-    if (f_data == NULL)
+    if (body_offset < 0 && ReadInfoFile() < 0)
+        return -1;
+    // a message that still holds its data needs no mapping
+    if (IsDataLoadad())
+        return 0;
+
+    int fd = open(spool_path, O_RDONLY);
+    if (fd < 0)
         return -1;
     
     ClearData();
 
-    char c;
-    while (fscanf(f_data, "%c", &c) > 0) {
-        data.AddChar(c);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != body_offset + body_length) {
+        write_log(
+            "[SMTP-DAEMON] Spool file %s has a wrong size\n",
+            spool_path
+        );
+        close(fd);
+        return -1;
     }
 
-    fclose(f_data);
-    return 0;
-}
-
+    char *map = (char*)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        write_log(
+            "[SMTP-DAEMON] Can't map spool file %s\n(%s)\n",
+            spool_path,
+            strerror(errno)
+        );
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
 
+    data_map = map;
+    data_map_length = st.st_size;
+    mapped_data = map + body_offset;
 
-char* Message::GenerateDataPath() const 
-{
-    int len;
-    char *path = GenerateCommonPath(len);
-    
-    MakeDir(path);
-    
-    memcpy(path + len, "data.txt", 8);
-    path[len + 8 + 1] = '\0';
-    
-    return path;
+    return 0;
 }
 
-char* Message::GenerateInfoPath() const 
+int Message::ParseSpoolRecord(const char *record, long size)
 {
-    int len;
-    char *path = GenerateCommonPath(len);
-    
-    MakeDir(path);
-    
-    memcpy(path + len, "info.txt", 8);
-    path[len + 8 + 1] = '\0';
-    
-    return path;
-}
+    const SpoolFileHeader *header = (const SpoolFileHeader*)record;
 
-char* Message::GenerateCommonPath(int &len) const 
-{
-    int max_len = 512;
-    char *buf = new char [max_len];
-    
-    len = strlen(server_options.queue_dir);
-    memcpy(buf, server_options.queue_dir, len);
-    
-    int at_pos = FindAtSymbolInAddress(id);
-    for (int i = 0; i < at_pos; i++) {
-        if ((('A' <= id[i]) && (id[i] <= 'Z')) || (('0' <= id[i]) && (id[i] <= '9'))) {
-            buf[len++] = id[i];
-            buf[len++] = '/';
-        }
+    if (!check_spool_envelope(record, size, size) ||
+        strcmp(record + spool_strings_offset(header), id)) {
+        write_log(
+            "[SMTP-DAEMON] Spool file %s is corrupted\n",
+            spool_path
+        );
+        return -1;
     }
-    buf[len] = '\0';
-    
-    return buf;
-}
 
+    const char *record_sender =
+        record + spool_strings_offset(header) + header->id_length + 1;
+    const SpoolFileRecipient *table =
+        (const SpoolFileRecipient*)(record + header->header_size);
 
+    sender_address = strdup(record_sender);
+    recipients_count = header->recipients_count;
+    recipients_address = new char* [recipients_count];
+    recipients_state = new RecipientState [recipients_count];
+    for (int i = 0; i < recipients_count; i++) {
+        recipients_address[i] = strdup(record + table[i].address_offset);
 
-void Message::ReplaceInfo(
-    const char *a_sender_address, 
-    char **a_recipients_address, 
-    int a_recipients_count
-)
-{
-    ClearInfo();
+        recipients_state[i].status = table[i].state.status;
+        recipients_state[i].attempts = table[i].state.attempts;
+        recipients_state[i].last_attempt = table[i].state.last_attempt;
+        recipients_state[i].next_attempt = table[i].state.next_attempt;
+        recipients_state[i].dirty = false;
+    }
 
-    sender_address = strdup(a_sender_address);
+    body_offset = header->body_offset;
+    body_length = header->body_length;
 
-    recipients_count = a_recipients_count;
-    recipients_address = new char* [recipients_count];
-    for (int i = 0; i < recipients_count; i++)
-        recipients_address[i] = strdup(a_recipients_address[i]);
+    return 0;
 }
 
-
-int Message::GenerateDataFile() const
+int Message::VerifySpoolFile(const char *path, SpoolRecordInfo *info)
 {
-    FILE *f_data = fopen(data_path, "w");
-    if (f_data == NULL)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
         return -1;
-    
-    InoutBuffer curline, cdata;
-    cdata.AddData(data.GetBuffer(), data.Length());
-    while (cdata.ReadLine(curline))
-        fprintf(f_data, "%s\n", curline.GetBuffer());
-    fclose(f_data);
-    
-    return 0;
-}
 
-int Message::GenerateInfoFile() const
-{
-    FILE *f_info = fopen(info_path, "w");
-    if (f_info == NULL)
+    struct stat st;
+    SpoolFileHeader header;
+    ssize_t len = -1;
+    if (fstat(fd, &st) == 0)
+        len = pread(fd, &header, sizeof(header), 0);
+
+    if (len != sizeof(header) || header.body_offset > (uint64_t)st.st_size) {
+        close(fd);
         return -1;
-    
-    fprintf(f_info, "%s\n%d\n", sender_address, recipients_count);
-    for (int i = 0; i < recipients_count; i++) 
-        fprintf(f_info, "%s\n", recipients_address[i]);
-    fclose(f_info);
-    
-    return 0;
-}
+    }
 
+    // only the envelope is read, most of them fit on the stack
+    char small_record[4096];
+    char *record = small_record;
+    if (header.body_offset > sizeof(small_record))
+        record = new char [header.body_offset];
+
+    bool valid =
+        pread(fd, record, header.body_offset, 0) == (ssize_t)header.body_offset &&
+        check_spool_envelope(record, header.body_offset, st.st_size);
+    close(fd);
+
+    if (valid) {
+        const SpoolFileRecipient *table =
+            (const SpoolFileRecipient*)(record + header.header_size);
+
+        info->id = strdup(record + spool_strings_offset(&header));
+        info->create_time = header.create_time;
+        info->last_attempt = 0;
+        info->pending_count = 0;
+        for (unsigned int i = 0; i < header.recipients_count; i++) {
+            if (table[i].state.last_attempt > info->last_attempt)
+                info->last_attempt = table[i].state.last_attempt;
+            if (table[i].state.status == rcpt_pending)
+                info->pending_count++;
+        }
+    }
 
+    if (record != small_record)
+        delete [] record;
 
-long unsigned int Message::GetTimeValue(const struct tm *timeinfo)
-{
-    long unsigned int time_val = 0;
-    
-    time_val += timeinfo->tm_sec;
-    time_val += timeinfo->tm_min * 100;
-    time_val += timeinfo->tm_hour * 10000;
-    time_val += timeinfo->tm_mday * 1000000;
-    time_val += timeinfo->tm_mon * 100000000;
-    time_val += (1900 + timeinfo->tm_year) * 10000000000;
-    
-    return time_val;
+    return valid ? 1: -1;
 }
 
-long unsigned int Message::GetRandValue(int size) 
+int Message::ConvertSpoolFile()
 {
-    long unsigned int rand_value = 0, d_deg = 1;
-    
-    for (int i = 0; i < size; i++) {
-        rand_value += (rand() % 10) * d_deg;
-        d_deg *= 10;
-    }
-    
-    return rand_value;
+    InoutBuffer wire;
+    MakeWireData(data.GetBuffer(), data.Length(), wire);
+    ClearData();
+    data.AddData(wire.GetBuffer(), wire.Length());
+
+    // offsets in the sidecar refer to the old data
+    MimeIndex mime_index;
+    mime_index.Build(data.GetBuffer(), data.Length());
+    GenerateMimeIndexFile(&mime_index);
+
+    write_log(
+        "[SMTP-DAEMON] Spool file %s converted to the current format\n",
+        spool_path
+    );
+    return GenerateSpoolFile();
 }
 
 
 
-char* Message::ReadLineFromFile(FILE *f, int &len) 
+char* Message::GenerateSpoolPath() const 
 {
-    int max_len = 256;
-    char *line = (char*)malloc(max_len * sizeof(*line));
-    len = 0;
-    
-    char c;
-    while (fscanf(f, "%c", &c) > 0) {
-        if (len + 1 >= max_len) {
-            char *new_line = new char [max_len * 2];
-            for (int i = 0; i < len; i++)
-                new_line[i] = line[i];
-            
-            delete[] line;
-            
-            line = new_line;
-            max_len *= 2;
-        }
-        
-        if (c == '\n')
-            break;
-        line[len++] = c;
-    }
-    line[len] = '\0';
-    
-    if (!len) {
-        delete[] line;
-        line = 0;
+    // <queue_dir>/XX/YY/<id>.spl, the buckets are created once at
+    // startup by PrepareSpoolDirectories
+    const char *queue_dir = server_options.queue_dir;
+    int dir_len = strlen(queue_dir);
+    bool need_slash = dir_len && queue_dir[dir_len - 1] != '/';
+
+    int id_len = FindAtSymbolInAddress(id);
+    if (id_len < 0)
+        id_len = strlen(id);
+
+    char *path = new char [dir_len + 1 + 6 + id_len + 4 + 1];
+    int len = 0;
+    memcpy(path, queue_dir, dir_len);
+    len += dir_len;
+    if (need_slash)
+        path[len++] = '/';
+
+    unsigned int hash = GetSpoolHash(id);
+    len += sprintf(path + len, "%02x/%02x/", hash & 0xff, (hash >> 8) & 0xff);
+
+    for (int i = 0; i < id_len; i++) {
+        char c = id[i];
+        bool safe = ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') ||
+            ('0' <= c && c <= '9') || c == '.' || c == '-' || c == '_';
+        path[len++] = safe ? c: '_';
     }
+    memcpy(path + len, ".spl", 4);
+    path[len + 4] = '\0';
     
-    return line;
+    return path;
 }
 
-
-void Message::MakeDir(const char *dir) 
+char* Message::GenerateMimePath(const char *a_spool_path)
 {
-    char tmp[256];
-    char *p = NULL;
-    size_t len;
+    int len = strlen(a_spool_path);
+    if (len >= 4 && !strcmp(a_spool_path + len - 4, ".spl"))
+        len -= 4;
 
-    snprintf(tmp, sizeof(tmp),"%s",dir);
-    len = strlen(tmp);
-    if(tmp[len - 1] == '/')
-        tmp[len - 1] = 0;
-    for(p = tmp + 1; *p; p++)
-        if(*p == '/') {
-            *p = 0;
-            mkdir(tmp, S_IRWXU);
-            *p = '/';
-        }
-    mkdir(tmp, S_IRWXU);
+    char *path = new char [len + 5 + 1];
+    memcpy(path, a_spool_path, len);
+    memcpy(path + len, ".mime", 5);
+    path[len + 5] = '\0';
+
+    return path;
 }
 
-void Message::ClearInfo() 
+unsigned int Message::GetSpoolHash(const char *an_id)
 {
-    if (sender_address)
-        free((void*)sender_address);
-    if (recipients_address) {
-        for (int i = 0; i < recipients_count; i++) 
-            if (recipients_address[i])
-                free((void*)recipients_address[i]);
-        delete [] recipients_address;
-    }
-
-    sender_address = 0;
-    recipients_address = 0;
-    recipients_count = 0;
+    return hash_data(k_hash_basis, an_id, strlen(an_id));
 }
 
-void Message::ClearData() 
+int Message::PrepareSpoolDirectories()
 {
-    data.DropAll();
-}
+    const char *queue_dir = server_options.queue_dir;
+    int dir_len = strlen(queue_dir);
+    char *path = new char [dir_len + 16];
+    strcpy(path, queue_dir);
+    if (dir_len && path[dir_len - 1] != '/')
+        path[dir_len++] = '/';
+
+    // a marker left by the last complete run saves 65k mkdir()s
+    strcpy(path + dir_len, ".layout");
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        delete [] path;
+        return 0;
+    }
+
+    path[dir_len] = '\0';
+    MakeDir(path);
+
+    for (int i = 0; i < 256; i++) {
+        sprintf(path + dir_len, "%02x", i);
+        if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+            write_log(
+                "[SMTP-DAEMON] Can't create spool directory %s\n(%s)\n",
+                path,
+                strerror(errno)
+            );
+            delete [] path;
+            return -1;
+        }
+        for (int j = 0; j < 256; j++) {
+            sprintf(path + dir_len, "%02x/%02x", i, j);
+            if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+                write_log(
+                    "[SMTP-DAEMON] Can't create spool directory %s\n(%s)\n",
+                    path,
+                    strerror(errno)
+                );
+                delete [] path;
+                return -1;
+            }
+        }
+    }
+
+    strcpy(path + dir_len, ".layout");
+    int fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd >= 0)
+        close(fd);
+
+    delete [] path;
+    return 0;
+}
+
+int Message::MoveToSpoolLayout()
+{
+    char *new_spool_path = GenerateSpoolPath();
+    if (!strcmp(new_spool_path, spool_path)) {
+        delete [] new_spool_path;
+        return 0;
+    }
+
+    if (rename(spool_path, new_spool_path) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't move spool file %s to %s\n(%s)\n",
+            spool_path,
+            new_spool_path,
+            strerror(errno)
+        );
+        delete [] new_spool_path;
+        return -1;
+    }
+
+    char *new_mime_path = GenerateMimePath(new_spool_path);
+    rename(mime_path, new_mime_path);
+
+    PruneOldDirectories(spool_path);
+
+    delete [] spool_path;
+    delete [] mime_path;
+    spool_path = new_spool_path;
+    mime_path = new_mime_path;
+
+    return 1;
+}
+
+Message* Message::ImportTextFiles(
+    const char *an_id,
+    const char *an_info_path,
+    const char *a_data_path,
+    time_t a_create_time,
+    const UserList *user_list
+)
+{
+    FILE *f_info = fopen(an_info_path, "r");
+    FILE *f_data = f_info ? fopen(a_data_path, "r"): 0;
+    if (!f_data) {
+        write_log(
+            "[SMTP-DAEMON] Can't read queued message %s (%s, %s)\n",
+            an_id,
+            an_info_path,
+            a_data_path
+        );
+        if (f_info)
+            fclose(f_info);
+        return 0;
+    }
+
+    Message *message = new Message(an_id, "", a_create_time);
+    delete [] message->spool_path;
+    delete [] message->mime_path;
+    message->spool_path = message->GenerateSpoolPath();
+    message->mime_path = GenerateMimePath(message->spool_path);
+
+    // the sender, the recipient count and one recipient per line
+    int len, count = -1;
+    message->sender_address = ReadLineFromFile(f_info, len);
+    if (fscanf(f_info, "%d\n", &count) == 1 && count >= 0) {
+        message->recipients_count = count;
+        message->recipients_address = new char* [count];
+        message->recipients_state = new RecipientState [count];
+        for (int i = 0; i < count; i++) {
+            message->recipients_address[i] = ReadLineFromFile(f_info, len);
+            memset(&message->recipients_state[i], 0, sizeof(RecipientState));
+            if (!message->recipients_address[i])
+                count = -1;
+        }
+    }
+    fclose(f_info);
+    if (count > 0)
+        message->ExpandAliases(user_list);
+
+    // the data was kept as the mailboxes keep it, LF line ends and
+    // no dot stuffing, which is what the conversion expects
+    char buf[4096];
+    while ((len = fread(buf, 1, sizeof(buf), f_data)) > 0)
+        message->data.AddData(buf, len);
+    bool data_ok = !ferror(f_data);
+    fclose(f_data);
+
+    if (!message->sender_address || count < 0 || !data_ok ||
+        message->ConvertSpoolFile() < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't convert queued message %s (%s)\n",
+            an_id,
+            an_info_path
+        );
+        delete message;
+        return 0;
+    }
+    message->ClearData();
+
+    remove(an_info_path);
+    remove(a_data_path);
+    PruneOldDirectories(an_info_path);
+
+    return message;
+}
+
+void Message::ExpandAliases(const UserList *user_list)
+{
+    int count = 0;
+    for (int i = 0; i < recipients_count; i++) {
+        char *address = recipients_address[i];
+
+        int user_idx = user_list->FindUserByAddress(address);
+        if (user_idx >= 0) {
+            const char *final_address = user_list->GetFinalAddress(user_idx);
+            if (strcmp(final_address, address)) {
+                free((void*)address);
+                address = strdup(final_address);
+            }
+        }
+
+        // aliases of one mailbox make one recipient, as at RCPT time
+        bool duplicate = false;
+        for (int j = 0; j < count && !duplicate; j++)
+            duplicate = !strcmp(recipients_address[j], address);
+
+        if (duplicate)
+            free((void*)address);
+        else
+            recipients_address[count++] = address;
+    }
+    recipients_count = count;
+}
+
+
+
+void Message::SetRecipientStatus(int idx, int status, time_t attempt_time)
+{
+    RecipientState *state = &recipients_state[idx];
+
+    state->status = status;
+    if (attempt_time) {
+        state->attempts++;
+        state->last_attempt = attempt_time;
+    }
+    state->dirty = true;
+}
+
+void Message::SetRecipientRetry(int idx, time_t next_attempt)
+{
+    recipients_state[idx].next_attempt = next_attempt;
+    recipients_state[idx].dirty = true;
+}
+
+int Message::WriteRecipientStates()
+{
+    int fd = -1, status = 0;
+    for (int i = 0; i < recipients_count; i++) {
+        if (!recipients_state[i].dirty)
+            continue;
+
+        if (fd < 0) {
+            fd = open(spool_path, O_WRONLY);
+            if (fd < 0) {
+                status = -1;
+                break;
+            }
+        }
+
+        SpoolFileRecipientState entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.status = recipients_state[i].status;
+        entry.attempts = recipients_state[i].attempts;
+        entry.last_attempt = recipients_state[i].last_attempt;
+        entry.next_attempt = recipients_state[i].next_attempt;
+
+        off_t offset = sizeof(SpoolFileHeader) +
+            i * sizeof(SpoolFileRecipient) +
+            offsetof(SpoolFileRecipient, state);
+        if (pwrite(fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
+            status = -1;
+            break;
+        }
+        recipients_state[i].dirty = false;
+    }
+
+    if (fd >= 0 && !status && fdatasync(fd) < 0)
+        status = -1;
+    if (status) {
+        write_log(
+            "[SMTP-DAEMON] Can't update recipients of spool file %s\n(%s)\n",
+            spool_path,
+            strerror(errno)
+        );
+    }
+    if (fd >= 0)
+        close(fd);
+
+    return status;
+}
+
+
+int Message::WriteTempSpoolFile()
+{
+    char *tmp_path = new char [strlen(spool_path) + 5];
+    sprintf(tmp_path, "%s.tmp", spool_path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't create spool file %s\n(%s)\n",
+            tmp_path,
+            strerror(errno)
+        );
+        delete [] tmp_path;
+        return -1;
+    }
+
+    int id_len = strlen(id);
+    int sender_len = strlen(sender_address);
+    long strings_offset = sizeof(SpoolFileHeader) +
+        recipients_count * sizeof(SpoolFileRecipient);
+    long offset = strings_offset + id_len + 1 + sender_len + 1;
+
+    InoutBuffer envelope;
+    SpoolFileHeader header;
+    memset(&header, 0, sizeof(header));
+    envelope.AddData(&header, sizeof(header));
+
+    for (int i = 0; i < recipients_count; i++) {
+        SpoolFileRecipient rcpt;
+        memset(&rcpt, 0, sizeof(rcpt));
+        rcpt.address_offset = offset;
+        rcpt.address_length = strlen(recipients_address[i]);
+        rcpt.state.status = recipients_state[i].status;
+        rcpt.state.attempts = recipients_state[i].attempts;
+        rcpt.state.last_attempt = recipients_state[i].last_attempt;
+        rcpt.state.next_attempt = recipients_state[i].next_attempt;
+        envelope.AddData(&rcpt, sizeof(rcpt));
+
+        offset += rcpt.address_length + 1;
+    }
+
+    envelope.AddData(id, id_len + 1);
+    envelope.AddData(sender_address, sender_len + 1);
+    for (int i = 0; i < recipients_count; i++)
+        envelope.AddData(recipients_address[i], strlen(recipients_address[i]) + 1);
+
+    memcpy(header.magic, k_spool_magic, sizeof(header.magic));
+    header.version = k_spool_version;
+    header.header_size = sizeof(header);
+    header.recipients_count = recipients_count;
+    header.id_length = id_len;
+    header.sender_length = sender_len;
+    header.create_time = create_time;
+    header.body_offset = envelope.Length();
+    header.body_length = GetDataLength();
+    header.flags = spool_flag_wire_data;
+    memcpy(&envelope[0], &header, sizeof(header));
+
+    header.checksum = spool_checksum(envelope.GetBuffer());
+    memcpy(&envelope[0], &header, sizeof(header));
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)envelope.GetBuffer();
+    iov[0].iov_len = envelope.Length();
+    iov[1].iov_base = (void*)GetData();
+    iov[1].iov_len = GetDataLength();
+
+    if (write_all(fd, iov, 2) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't write spool file %s\n(%s)\n",
+            tmp_path,
+            strerror(errno)
+        );
+        close(fd);
+        remove(tmp_path);
+        delete [] tmp_path;
+        return -1;
+    }
+    delete [] tmp_path;
+
+    // the new record holds the current recipient states, a mapping
+    // of the old one stays valid until ClearData
+    for (int i = 0; i < recipients_count; i++)
+        recipients_state[i].dirty = false;
+    body_offset = header.body_offset;
+    body_length = header.body_length;
+
+    return fd;
+}
+
+int Message::GenerateSpoolFile()
+{
+    int fd = WriteTempSpoolFile();
+    if (fd < 0)
+        return -1;
+
+    char *tmp_path = new char [strlen(spool_path) + 5];
+    sprintf(tmp_path, "%s.tmp", spool_path);
+
+    int status = 0;
+    if (fdatasync(fd) < 0 || rename(tmp_path, spool_path) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't commit spool file %s\n(%s)\n",
+            spool_path,
+            strerror(errno)
+        );
+        remove(tmp_path);
+        status = -1;
+    }
+    close(fd);
+    delete [] tmp_path;
+
+    return status;
+}
+
+int Message::GenerateMimeIndexFile(const MimeIndex *mime_index) const
+{
+    return mime_index->Save(mime_path);
+}
+
+int Message::ReadMimeIndexFile(MimeIndex *mime_index) const
+{
+    return mime_index->Load(mime_path);
+}
+
+
+
+long unsigned int Message::GetTimeValue(const struct tm *timeinfo)
+{
+    long unsigned int time_val = 0;
+    
+    time_val += timeinfo->tm_sec;
+    time_val += timeinfo->tm_min * 100;
+    time_val += timeinfo->tm_hour * 10000;
+    time_val += timeinfo->tm_mday * 1000000;
+    time_val += timeinfo->tm_mon * 100000000;
+    time_val += (1900 + timeinfo->tm_year) * 10000000000;
+    
+    return time_val;
+}
+
+long unsigned int Message::GetRandValue(int size) 
+{
+    long unsigned int rand_value = 0, d_deg = 1;
+    
+    for (int i = 0; i < size; i++) {
+        rand_value += (rand() % 10) * d_deg;
+        d_deg *= 10;
+    }
+    
+    return rand_value;
+}
+
+
+
+char* Message::ReadLineFromFile(FILE *f, int &len) 
+{
+    int max_len = 256;
+    char *line = (char*)malloc(max_len * sizeof(*line));
+    len = 0;
+    
+    int c;
+    while ((c = getc(f)) != EOF && c != '\n') {
+        if (len + 1 >= max_len) {
+            max_len *= 2;
+            line = (char*)realloc(line, max_len * sizeof(*line));
+        }
+        line[len++] = c;
+    }
+    line[len] = '\0';
+    
+    if (!len) {
+        free((void*)line);
+        line = 0;
+    }
+    
+    return line;
+}
+
+
+void Message::PruneOldDirectories(const char *path)
+{
+    // the old layouts had one directory level per id character,
+    // prune the chain as long as it is empty
+    int queue_dir_len = strlen(server_options.queue_dir);
+    char *dir = strdup(path);
+    for (;;) {
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash - dir <= queue_dir_len)
+            break;
+        *slash = '\0';
+        if (rmdir(dir) < 0)
+            break;
+    }
+    free((void*)dir);
+}
+
+void Message::MakeDir(const char *dir) 
+{
+    char tmp[256];
+    char *p = NULL;
+    size_t len;
+
+    snprintf(tmp, sizeof(tmp),"%s",dir);
+    len = strlen(tmp);
+    if(tmp[len - 1] == '/')
+        tmp[len - 1] = 0;
+    for(p = tmp + 1; *p; p++)
+        if(*p == '/') {
+            *p = 0;
+            mkdir(tmp, S_IRWXU);
+            *p = '/';
+        }
+    mkdir(tmp, S_IRWXU);
+}
+
+void Message::ClearInfo() 
+{
+    if (sender_address)
+        free((void*)sender_address);
+    if (recipients_address) {
+        for (int i = 0; i < recipients_count; i++) 
+            if (recipients_address[i])
+                free((void*)recipients_address[i]);
+        delete [] recipients_address;
+    }
+    if (recipients_state)
+        delete [] recipients_state;
+
+    sender_address = 0;
+    recipients_address = 0;
+    recipients_state = 0;
+    recipients_count = 0;
+}
+
+void Message::ClearData() 
+{
+    data.DropAll();
+
+    if (data_map)
+        munmap(data_map, data_map_length);
+    data_map = 0;
+    data_map_length = 0;
+    mapped_data = 0;
+}
 
 
 
@@ -427,16 +1211,56 @@ MailQueue::MailQueue(
     domain = strdup(a_domain);
     user_list = an_user_list;
     
-    message_count = 0;
     max_message_count = a_max_message_count;
-    message_list = new Message* [max_message_count];
-    memset(message_list, 0, max_message_count * sizeof(Message*));
-    
-    last_send_attempt = new time_t [max_message_count];
-    memset(last_send_attempt, 0, max_message_count * sizeof(time_t));
     
     lifetime = 4 * 24 * 60 * 60;
     sending_delay = 30 * 60;
+    reply_retry_delay = server_options.reply_retry_delay;
+    max_retry_delay = server_options.max_retry_delay;
+
+    // the retry jitter has to differ from one run to the next
+    srand(time(0) ^ getpid());
+
+    queue_filename = strdup(server_options.queue_file);
+
+    journal.SetSyncPolicy(
+        server_options.journal_fsync_batch,
+        server_options.journal_fsync_interval
+    );
+    journal.SetCompactThreshold(server_options.journal_compact_records);
+
+    max_delivery_count = server_options.max_deliveries > 0 ? 
+        server_options.max_deliveries: 1;
+    delivery_count = 0;
+    deliveries_size = max_delivery_count;
+    deliveries = new SMTPClientSession* [deliveries_size];
+    limits.SetLimits(
+        server_options.max_domain_connections,
+        server_options.max_address_connections
+    );
+
+    mailboxes.SetMaxCount(server_options.mailbox_cache_size);
+    use_maildir = !strcasecmp(server_options.mailbox_format, "maildir");
+
+    connection_cache.SetDeliveryLimits(&limits);
+    connection_cache.SetPolicy(
+        server_options.connection_idle_time,
+        server_options.connection_max_messages
+    );
+    health.SetPolicy(
+        server_options.circuit_failures,
+        server_options.circuit_open_time
+    );
+
+    // a host that does not resolve is left out, mail is not sent
+    // straight to the exchanges behind the relay's back
+    relay.SetMaxHostConnections(server_options.relay_max_host_connections);
+    if (relay.Load(server_options.relay_hosts) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Relay list %s is incomplete\n",
+            server_options.relay_hosts
+        );
+    }
 }
 
 MailQueue::~MailQueue() 
@@ -444,16 +1268,20 @@ MailQueue::~MailQueue()
     if (domain)
         free((void*)domain);
 
-    if (message_list) {
-        for (int i = 0; i < max_message_count; i++) {
-            if (message_list[i]) 
-                delete message_list[i];
-        }
-        delete[] message_list;
+    // the transactions still running are dropped, the messages are
+    // tried again after the restart
+    for (int i = 0; i < delivery_count; i++)
+        delete deliveries[i];
+    delete [] deliveries;
+
+    for (int i = 0; i < index.GetCapacity(); i++) {
+        QueueEntry *entry = index.GetEntry(i);
+        if (entry->message) 
+            delete entry->message;
     }
 
-    if (last_send_attempt)
-        delete [] last_send_attempt;
+    if (queue_filename)
+        free((void*)queue_filename);
 }
 
 
@@ -465,7 +1293,7 @@ int MailQueue::AddMessage(Message *message)
         message->GetId()
     );
 
-    if (message_count >= max_message_count) {
+    if (max_message_count > 0 && index.GetCount() >= max_message_count) {
         write_log(
             "[SMTP-DAEMON] Message %s rejected due mail queue is full\n",
             message->GetId()
@@ -483,89 +1311,97 @@ int MailQueue::AddMessage(Message *message)
         }
     }
 
+    DeliverLocal(message);
+    
+    if (message->GetPendingRecipientsCount() > 0) {
+        message->WriteRecipientStates();
+
+        InsertMessage(message, 0);
+        journal.AppendAdd(
+            message->GetId(),
+            message->GetSpoolPath(),
+            message->GetCreateTime()
+        );
+
+        write_log(
+            "[SMTP-DAEMON] Message %s added to mail queue\n", 
+            message->GetId()
+        );
+
+        // the data is on disk now, remote attempts send it from there
+        message->ClearData();
+    } else {
+        // every recipient was local, nothing is left to send
+        message->DeleteMessage();
+        delete message;
+    }
+
+    return index.GetCount();
+}
+
+void MailQueue::DeliverLocal(Message *message)
+{
     const char *sender_address = message->GetSenderAddress();
     int recipients_count = message->GetRecipientsCount();
     char **recipients_address = message->GetRecipientsAddress();
 
+    time_t curtime;
+    time(&curtime);
 
-    int far_recipients_count = 0;
-    char **far_recipients_address = new char* [recipients_count];
-    memset(far_recipients_address, 0, recipients_count * sizeof(char*));
-    
+    InoutBuffer mailbox_data;
+    MaildirDelivery maildir(domain);
     for (int i = 0; i < recipients_count; i++) {
-        int atpos = Message::FindAtSymbolInAddress(recipients_address[i]);
-        if (!strcmp(recipients_address[i] + atpos + 1, domain)) {
-            int status = DeliverMessage(message, sender_address, recipients_address[i]);
+        if (message->GetRecipientStatus(i) != Message::rcpt_pending)
+            continue;
 
-            if (!status) {
-                write_log(
-                    "[SMTP-DAEMON] Message %s local delivered to %s\n",
-                    message->GetId(),
-                    recipients_address[i]
-                );
-            } else if (status == 1) {
-                write_log("[SMTP-DAEMON] Message %s replaced\n", message->GetId());
-            } else {
-                write_log(
-                    "[SMTP-DAEMON] Error: Message %s "
-                    "local delivery to %s\n failed",
-                    message->GetId(),
-                    recipients_address[i]
-                );
-            }
+        int atpos = Message::FindAtSymbolInAddress(recipients_address[i]);
+        if (strcmp(recipients_address[i] + atpos + 1, domain))
+            continue;
 
-        } else {
-            far_recipients_address[far_recipients_count++] = strdup(recipients_address[i]);
-        } 
-    }
-    
-    if (far_recipients_count > 0) {
-        char *new_sender_address = strdup(sender_address);
-        message->ReplaceInfo(
-            new_sender_address, 
-            far_recipients_address, 
-            far_recipients_count
+        int status = DeliverMessage(
+            message,
+            sender_address,
+            recipients_address[i],
+            mailbox_data,
+            maildir
         );
-        message->GenerateInfoFile();
-        //message->ReadInfoFile();
-        free((void*)new_sender_address);
 
-        for (int i = 0; i < max_message_count; i++) {
-            if (!message_list[i]) {
-                message_list[i] = message;
-                break;
-            }
+        if (!status) {
+            write_log(
+                "[SMTP-DAEMON] Message %s local delivered to %s\n",
+                message->GetId(),
+                recipients_address[i]
+            );
+        } else {
+            write_log(
+                "[SMTP-DAEMON] Error: Message %s "
+                "local delivery to %s\n failed",
+                message->GetId(),
+                recipients_address[i]
+            );
         }
-        message_count++;
 
-        write_log(
-            "[SMTP-DAEMON] Message %s added to mail queue\n", 
-            message->GetId()
+        // local deliveries are never retried
+        message->SetRecipientStatus(
+            i,
+            status < 0 ? Message::rcpt_failed: Message::rcpt_delivered,
+            curtime
         );
-        
-        SaveQueue(server_options.queue_file);
     }
-    
-    for (int i = 0; i < far_recipients_count; i++) 
-        free((void*)far_recipients_address[i]);
-    delete [] far_recipients_address;
-
-    return message_count;
 }
 
 int MailQueue::DeleteMessageFromQueue(int message_idx) 
 {
-    if ((message_idx < 0) || (message_idx >= max_message_count))
+    if ((message_idx < 0) || (message_idx >= index.GetCapacity()))
         return -1;
-    if (!message_list[message_idx])
-        return -2;
 
-    message_list[message_idx]->DeleteMessage();
+    Message *message = index.GetEntry(message_idx)->message;
+    if (!message)
+        return -2;
 
-    delete message_list[message_idx];
-    message_list[message_idx] = 0;
-    last_send_attempt[message_idx] = 0;
-    message_count--;
+    journal.AppendRemove(message->GetId());
+    message->DeleteMessage();
+    DropMessage(message_idx);
 
     return 0;
 }
@@ -574,7 +1410,9 @@ int MailQueue::DeleteMessageFromQueue(int message_idx)
 
 int MailQueue::DeliverMessage(
     Message *message,
-    const char *sender_address, const char *recipient_address
+    const char *sender_address, const char *recipient_address,
+    InoutBuffer &mailbox_data,
+    MaildirDelivery &maildir
 ) 
 { 
     write_log(
@@ -591,59 +1429,80 @@ int MailQueue::DeliverMessage(
         return -1;
     }
     
-    if (!message->IsDataLoadad()) {
-        if (message->ReadDataFile() < 0) {
-            write_log("[SMTP-DAEMON] Error: could not read data file\n");
-            return -1;
-        }
+    if (message->ReadDataFile() < 0) {
+        write_log("[SMTP-DAEMON] Error: could not read data file\n");
+        return -1;
     }
     
-    if (user_list->GetRedirectPath(user_idx)) {
-        //return DeliverMessage(message, sender_address, user_list->GetRedirectPath(user_idx));
-        
-        if (message_count >= max_message_count)
-            SetMaxMessageCount(2 * max_message_count);
-        
-        char **recipients_address = new char* [1];
-        recipients_address[0] = strdup(user_list->GetRedirectPath(user_idx));
-        
-        Message *new_message = new Message(
+    // the users may have been redirected since the mail was queued,
+    // the flattened map says where the mail goes now
+    const char *final_address = user_list->GetFinalAddress(user_idx);
+    int final_idx = user_list->FindUserByAddress(final_address);
+    if (final_idx >= 0) {
+        user_idx = final_idx;
+    } else {
+        // the user was redirected away after the mail was queued, it
+        // is kept here like the mail of a user in a redirect cycle
+        write_log(
+            "[SMTP-DAEMON] Message %s for %s is redirected to %s since "
+            "it was queued, keeping it in the own mailbox\n",
             message->GetId(),
-            sender_address, 
-            recipients_address, 1,
-            message->GetData()
+            recipient_address,
+            final_address
         );
-        AddMessage(new_message);
-        
-        free((void*)recipients_address[0]);
-        delete[] recipients_address;
-        
-        return 1;
     }
     
+    // the data is converted once for all the local recipients
+    if (!mailbox_data.Length() && message->GetDataLength() > 0) {
+        Message::MakeMailboxData(
+            message->GetData(), message->GetDataLength(), mailbox_data
+        );
+    }
+
     const char *mail_path = user_list->GetPathToMail(user_idx);
-    FILE *f = fopen(mail_path, "a");
-    if (f == 0) {
+    InoutBuffer envelope;
+    iovec record[3];
+    int status;
+
+    if (use_maildir) {
+        // one file for all the recipients, so only the sender goes
+        // into it
+        envelope.AddString("Return-Path: <");
+        envelope.AddString(sender_address);
+        envelope.AddString(">\n");
+
+        record[0].iov_base = (void*)envelope.GetBuffer();
+        record[0].iov_len = envelope.Length();
+        record[1].iov_base = (void*)mailbox_data.GetBuffer();
+        record[1].iov_len = mailbox_data.Length();
+        status = maildir.Deliver(mail_path, record, 2);
+    } else {
+        envelope.AddString("MAIL FROM: ");
+        envelope.AddString(sender_address);
+        envelope.AddString("\nRCPT TO: ");
+        envelope.AddString(recipient_address);
+        envelope.AddString("\nDATA\n");
+
+        record[0].iov_base = (void*)envelope.GetBuffer();
+        record[0].iov_len = envelope.Length();
+        record[1].iov_base = (void*)mailbox_data.GetBuffer();
+        record[1].iov_len = mailbox_data.Length();
+        record[2].iov_base = (void*)".\n\n";
+        record[2].iov_len = 3;
+        status = mailboxes.Append(mail_path, record, 3);
+    }
+
+    if (status < 0) {
         write_log(
-            "[SMTP-DAEMON] Message %s local delivery failed due spool file opening fail\n",
-            message->GetId()
+            "[SMTP-DAEMON] Message %s local delivery to %s failed: %s\n",
+            message->GetId(),
+            mail_path,
+            strerror(errno)
         );
 
         return -1;
     }
     
-    fprintf(f, "MAIL FROM: %s\n", sender_address);
-    fprintf(f, "RCPT TO: %s\n", recipient_address);
-    fprintf(f, "DATA\n");
-    
-    InoutBuffer curline, data;
-    data.AddData(message->GetData()->GetBuffer(), message->GetData()->Length());
-    while (data.ReadLine(curline))
-        fprintf(f, "%s\n", curline.GetBuffer());
-    fprintf(f, ".\n\n");
-    
-    fclose(f);
-    
     write_log(
         "[SMTP-DAEMON] Message %s local delivery done\n", 
         message->GetId()
@@ -654,145 +1513,94 @@ int MailQueue::DeliverMessage(
 
 int MailQueue::SendMessage(int message_idx) 
 { 
+    QueueEntry *entry = index.GetEntry(message_idx);
+    Message *message = entry->message;
+
     write_log(
         "[SMTP-DAEMON] Message %s sending initiate\n",
-        message_list[message_idx]->GetId()
+        message->GetId()
     );
 
-    if (!message_list[message_idx]->IsInfoLoaded()) {
-        if (message_list[message_idx]->ReadInfoFile() < 0)
+    if (!message->IsInfoLoaded()) {
+        if (message->ReadInfoFile() < 0)
             return -1;
     }
 
-    if (!message_list[message_idx]->IsDataLoadad())
-        if (message_list[message_idx]->ReadDataFile() < 0)
-            return -1;
-
-    const char *sender_address = message_list[message_idx]->GetSenderAddress();
-    int recipients_count = message_list[message_idx]->GetRecipientsCount();
-    char **recipients_address = message_list[message_idx]->GetRecipientsAddress();
-
-    InoutBuffer data;
-    data.AddData(
-        message_list[message_idx]->GetData()->GetBuffer(), 
-        message_list[message_idx]->GetData()->Length()
-    );
+    int recipients_count = message->GetRecipientsCount();
+    char **recipients_address = message->GetRecipientsAddress();
 
+    // recipients already delivered or failed stay in the record, a
+    // domain is tried once one of its pending recipients is due and
+    // then takes the rest of them along
+    time_t curtime = time(0);
+    int pending_count = 0;
+    char **pending_address = new char* [recipients_count];
+    for (int i = 0; i < recipients_count; i++) {
+        if (message->IsRecipientDue(i, curtime))
+            pending_address[pending_count++] = recipients_address[i];
+    }
 
+    // the smarthosts take mail for every domain, so relayed mail
+    // goes out in one transaction
     int domains_count;
-    char **domains = GetDomains(
-        recipients_address, 
-        recipients_count, 
-        &domains_count
-    );
-    
-    bool *domains_done = new bool [domains_count];
-    memset(domains_done, 0, domains_count * sizeof(bool));
+    char **domains;
+    if (relay.IsEnabled()) {
+        domains = new char* [1];
+        domains_count = 0;
+        if (pending_count > 0)
+            domains[domains_count++] = strdup(RelayHosts::K_DESTINATION);
+    } else {
+        domains = GetDomains(
+            pending_address, 
+            pending_count, 
+            &domains_count
+        );
+    }
     
+    // one transaction per domain, they all run side by side
+    int *domain_recipients = new int [recipients_count];
     for (int i = 0; i < domains_count; i++) {
-        char *mx_record;
-        if ((mx_record = dns_mx_resolver.GetMXWithLowestPreference(domains[i])) == 0)
-            continue;
-
-        //write_log("MX = (%s)\n", mx_record);
-        
-        in_addr *ip_addr = GetIPAddress(mx_record);
-        delete [] mx_record;
-        
-        int sock_fd = ConnectToServer(ip_addr);
-        if (sock_fd < 0)
-            continue;
-
-        GetReply(sock_fd);
-
         int domain_recipients_count = 0;
-        char **domain_recipients = new char* [recipients_count];
-        
         for (int j = 0; j < recipients_count; j++) {
-            int atpos = Message::FindAtSymbolInAddress(recipients_address[j]);
-            if (!strcmp(recipients_address[j] + atpos + 1, domains[i]))
-                domain_recipients[domain_recipients_count++] = recipients_address[j];
-        }
-
-        if (SendInfo(
-                sock_fd, 
-                domain, domains[i], 
-                sender_address, 
-                domain_recipients, domain_recipients_count
-            ) < 0) {
-            DisconnectFromServer(sock_fd);
-            delete [] domain_recipients;
-            continue;
-        }
-
-        if (SendData(sock_fd, message_list[message_idx]->GetId(), &data) < 0) {
-            DisconnectFromServer(sock_fd);
-            delete [] domain_recipients;
-            continue;
-        }
-        
-        WriteToSocket(sock_fd, "QUIT\r\n", 6);
-        DisconnectFromServer(sock_fd);
-        delete [] domain_recipients;
-        
-        domains_done[i] = 1;
-    }
-    
-    bool all_domains_done = 1;
-    for (int i = 0; i < domains_count; i++) {
-        if (!domains_done[i]) {
-            all_domains_done = 0;
-            break;
-        }
-    }
-    
-    if (!all_domains_done) {
-        int new_recipients_count = 0;
-        char **new_recipients_address = new char* [recipients_count];
-        
-        for (int i = 0; i < domains_count; i++) {
-            if (domains_done[i])
+            if (message->GetRecipientStatus(j) != Message::rcpt_pending)
                 continue;
-            
-            for (int j = 0; j < recipients_count; j++) {
-                int atpos = Message::FindAtSymbolInAddress(recipients_address[j]);
-                if (!strcmp(recipients_address[j] + atpos + 1, domains[i]))
-                    new_recipients_address[new_recipients_count++] = strdup(recipients_address[j]);
-            }
-            
-        }
-        char *new_sender_address = strdup(sender_address);
-        message_list[message_idx]->ReplaceInfo(
-            new_sender_address,
-            new_recipients_address,
-            new_recipients_count
-        );
-        message_list[message_idx]->GenerateInfoFile();
-        //message_list[message_idx]->ReadInfoFile();
-        
-        free((void*)new_sender_address);
-        for (int i = 0; i < new_recipients_count; i++) 
-            free((void*)new_recipients_address[i]);
-        delete[] new_recipients_address;
 
-        write_log(
-            "[SMTP-DAEMON] Message %s send partial done\n",
-            message_list[message_idx]->GetId()
-        );
-    } else {
-        write_log(
-            "[SMTP-DAEMON] Message %s send completely done, message removed from queue\n",
-            message_list[message_idx]->GetId()
+            int atpos = Message::FindAtSymbolInAddress(recipients_address[j]);
+            if (relay.IsEnabled() ||
+                !strcmp(recipients_address[j] + atpos + 1, domains[i]))
+                domain_recipients[domain_recipients_count++] = j;
+        }
+
+        SMTPClientSession *session = new SMTPClientSession(
+            message,
+            domains[i],
+            domain,
+            domain_recipients,
+            domain_recipients_count,
+            &limits,
+            &connection_cache,
+            &domain_queue,
+            &health,
+            relay.IsEnabled() ? &relay: 0
         );
+        AddDelivery(session);
+        entry->deliveries++;
+
+        session->Start();
     }
-    
+    delete [] domain_recipients;
+
+    // the entry is scheduled again once the last transaction is over
+    if (domains_count > 0)
+        index.Unschedule(message_idx);
+
     for (int i = 0; i < domains_count; i++) 
         if (domains[i])
             free((void*)domains[i]);
     delete[] domains;
-    delete[] domains_done;
+    delete[] pending_address;
 
-    return all_domains_done? 0: -1;
+    return domains_count;
 }
 
 
@@ -802,55 +1610,122 @@ void MailQueue::HandleQueue()
     time_t curtime;
     time(&curtime);
     
-    bool queue_changed = 0;
-    for (int i = 0; i < max_message_count; i++) {
-        if (!message_list[i])
-            continue;
+    // only the entries that are due are looked at, every one of them
+    // is either removed, handed to the outbound transactions or
+    // scheduled again for later
+    int i;
+    while (CanStartDeliveries() && (i = index.GetFirstDue(curtime)) >= 0) {
+        QueueEntry *entry = index.GetEntry(i);
         
-        if (curtime - message_list[i]->GetCreateTime() > lifetime) {
-            queue_changed = 1;
+        if (curtime - entry->message->GetCreateTime() > lifetime) {
             DeleteMessageFromQueue(i);
+            continue;
         }
         
-        if (curtime - last_send_attempt[i] > sending_delay ||
-            !last_send_attempt) {
-            if (!SendMessage(i)) {
-                queue_changed = 1;
-                DeleteMessageFromQueue(i);
-            }
-            else {
-                last_send_attempt[i] = curtime;
-            }
+        int started = SendMessage(i);
+        if (started == 0 && entry->message->GetPendingRecipientsCount()) {
+            // the recipients left are not due yet
+            ScheduleMessage(i);
+        }
+        else if (started == 0) {
+            // nothing is left to send
+            DeleteMessageFromQueue(i);
+        }
+        else if (started < 0) {
+            entry->last_attempt = curtime;
+            journal.AppendAttempt(entry->message->GetId(), curtime);
+            ScheduleMessage(i);
         }
     }
     
-    if (queue_changed) {
-        SaveQueue(server_options.queue_file);
+    journal.SyncIfDue();
+    if (journal.ShouldCompact())
+        Checkpoint();
+}
+
+
+void MailQueue::GetDeliveryFds(
+    fd_set &read_fds, 
+    fd_set &write_fds, 
+    int &max_fd
+) const
+{
+    dns_mx_resolver.GetFds(read_fds, max_fd);
+
+    for (int i = 0; i < delivery_count; i++) {
+        int fd = deliveries[i]->GetFd();
+        if (fd < 0)
+            continue;
+
+        if (deliveries[i]->WantsRead())
+            FD_SET(fd, &read_fds);
+        if (deliveries[i]->WantsWrite())
+            FD_SET(fd, &write_fds);
+        if (fd > max_fd)
+            max_fd = fd;
+    }
+
+    connection_cache.GetFds(read_fds, max_fd);
+}
+
+void MailQueue::HandleDeliveries(
+    const fd_set &read_fds, 
+    const fd_set &write_fds
+)
+{
+    dns_mx_resolver.HandleReplies(read_fds);
+
+    time_t curtime;
+    time(&curtime);
+    dns_mx_resolver.CheckTimeouts(curtime);
+
+    // a cached connection that goes away frees its address slot
+    bool released = connection_cache.HandleEvents(read_fds, curtime) > 0;
+    for (int i = 0; i < delivery_count; i++) {
+        SMTPClientSession *session = deliveries[i];
+
+        int fd = session->GetFd();
+        if (fd >= 0) {
+            session->HandleIO(
+                FD_ISSET(fd, &read_fds), 
+                FD_ISSET(fd, &write_fds)
+            );
+        }
+        session->CheckTimeout(curtime);
+
+        if (!session->IsFinished())
+            continue;
+
+        // the last session takes the freed slot
+        deliveries[i] = deliveries[--delivery_count];
+        deliveries[delivery_count] = 0;
+        i--;
+
+        FinishDelivery(session, curtime);
+        delete session;
+        released = true;
+    }
+
+    // the sessions waiting for an address get the slots just freed,
+    // the ones waiting for a domain were woken by the session that
+    // gave its slot up
+    if (released) {
+        for (int i = 0; i < delivery_count; i++)
+            deliveries[i]->Resume();
     }
 }
 
 
 
-int MailQueue::GetMessageCount() const { return message_count; }
+int MailQueue::GetMessageCount() const { return index.GetCount(); }
 
 int MailQueue::GetMaxMessageCount() const { return max_message_count; }
 
 int MailQueue::SetMaxMessageCount(int a_max_message_count) 
 {
-    if (a_max_message_count < message_count) 
+    if (a_max_message_count > 0 && a_max_message_count < index.GetCount()) 
         return -1;
     
-    Message **new_message_list = new Message* [a_max_message_count];
-    memset(new_message_list, 0, a_max_message_count * sizeof(Message*));
-    
-    for (int i = 0, p = 0; i < max_message_count; i++) {
-        if (message_list[i])
-            new_message_list[p++] = message_list[i];
-    }
-    
-    delete[] message_list;
-    
-    message_list = new_message_list;
     max_message_count = a_max_message_count;
     
     return 0;
@@ -859,304 +1734,550 @@ int MailQueue::SetMaxMessageCount(int a_max_message_count)
 void MailQueue::SetMaxMessageLifeTime(time_t a_lifetime) 
 {
     lifetime = a_lifetime;
+    RescheduleMessages();
 }
 
 void MailQueue::SetSendingDelay(time_t a_sending_delay) 
 {
     sending_delay = a_sending_delay;
+    RescheduleMessages();
 }
 
 
 
 int MailQueue::LoadQueue(const char *filename) 
 {    
+    if (filename != queue_filename) {
+        free((void*)queue_filename);
+        queue_filename = strdup(filename);
+    }
+
+    if (Message::PrepareSpoolDirectories() < 0)
+        return -1;
+
+    int imported = 0;
     FILE *f = fopen(filename, "r");
     if (f == 0) {
         write_log(
             "[SMTP-DAEMON] Can't open %s file to load mailqueue\n", 
             filename
         );
+    } else {
+        int count = 0;
+        fscanf(f, "%d\n", &count);
+
+        char *id, *spool_path, *third;
+        long int create_time, last_attempt;
+
+        for (int i = 0; i < count; i++) {
+            int len;
+
+            // id, spool path, create time and last attempt; the first
+            // format had id, info path, data path and create time
+            id = Message::ReadLineFromFile(f, len);
+            spool_path = Message::ReadLineFromFile(f, len);
+            third = Message::ReadLineFromFile(f, len);
+            char *data_path = 0;
+            if (third && !is_number(third)) {
+                data_path = third;
+                third = Message::ReadLineFromFile(f, len);
+                last_attempt = 0;
+            } else if (fscanf(f, "%ld\n", &last_attempt) != 1) {
+                free((void*)third);
+                third = 0;
+            }
+
+            if (!id || !spool_path || !third || !is_number(third)) {
+                write_log(
+                    "[SMTP-DAEMON] Mailqueue checkpoint %s is truncated\n",
+                    filename
+                );
+                free((void*)id);
+                free((void*)spool_path);
+                free((void*)data_path);
+                free((void*)third);
+                break;
+            }
+            create_time = atol(third);
+
+            Message *message;
+            if (data_path) {
+                message = Message::ImportTextFiles(
+                    id, spool_path, data_path, create_time, user_list
+                );
+                if (message) {
+                    imported++;
+
+                    // an expanded alias may name a local mailbox
+                    DeliverLocal(message);
+                    message->ClearData();
+                    if (message->GetPendingRecipientsCount() == 0) {
+                        message->DeleteMessage();
+                        delete message;
+                        message = 0;
+                    } else {
+                        message->WriteRecipientStates();
+                    }
+                }
+            } else {
+                message = new Message(id, spool_path, create_time);
+            }
+            if (message && InsertMessage(message, last_attempt) < 0)
+                delete message;
+
+            free((void*)id);
+            free((void*)spool_path);
+            free((void*)data_path);
+            free((void*)third);
+        }
+
+        fclose(f);
+    }
+
+    const char *journal_file = server_options.journal_file;
+    char *default_journal_file = 0;
+    if (!journal_file[0]) {
+        default_journal_file = new char [strlen(filename) + 9];
+        sprintf(default_journal_file, "%s.journal", filename);
+        journal_file = default_journal_file;
+    }
+
+    int status = journal.Open(journal_file);
+    delete [] default_journal_file;
+    if (status < 0)
         return -1;
+
+    int replayed = 0;
+    if (!journal.BeginReplay()) {
+        QueueJournalRecord rec;
+        while (journal.ReadRecord(&rec) > 0) {
+            int idx = FindMessageById(rec.id);
+
+            switch (rec.type) {
+                case QueueJournal::rec_add:
+                    if (idx < 0) {
+                        Message *message = new Message(
+                            rec.id, rec.spool_path, rec.time
+                        );
+                        if (InsertMessage(message, 0) < 0)
+                            delete message;
+                    }
+                    break;
+                case QueueJournal::rec_attempt:
+                    if (idx >= 0) {
+                        index.GetEntry(idx)->last_attempt = rec.time;
+                        ScheduleMessage(idx);
+                    }
+                    break;
+                case QueueJournal::rec_remove:
+                    if (idx >= 0)
+                        DropMessage(idx);
+                    break;
+            }
+            replayed++;
+        }
+        journal.EndReplay();
     }
-    
-    fscanf(f, "%d\n", &message_count);
-    
-    char *id, *info_path, *data_path;
-    time_t create_time;
-    
-    for (int i = 0; i < message_count; i++) {
-        int len;
-        
-        id = Message::ReadLineFromFile(f, len);
-        info_path = Message::ReadLineFromFile(f, len);
-        data_path = Message::ReadLineFromFile(f, len);
-        fscanf(f, "%ld\n", &create_time);
-        
-        message_list[i] = new Message(id, info_path, data_path, create_time);
-        
-        free((void*)id);
-        free((void*)info_path);
-        free((void*)data_path);
+
+    int migrated = 0;
+    for (int i = 0; i < index.GetCapacity(); i++) {
+        Message *message = index.GetEntry(i)->message;
+        if (message && message->MoveToSpoolLayout() > 0)
+            migrated++;
     }
-    
-    fclose(f);
-    
-    return 0;
+
+    write_log(
+        "[SMTP-DAEMON] Mailqueue loaded: %d messages, %d journal records, "
+        "%d moved to the hashed spool layout, %d converted from text files\n",
+        index.GetCount(),
+        replayed,
+        migrated,
+        imported
+    );
+
+    int recovered = 0;
+    if (server_options.recovery_threads > 0)
+        recovered = Recover();
+
+    // fold the replayed, moved, converted and recovered records into a
+    // fresh checkpoint
+    return (replayed || migrated || imported || recovered) ? Checkpoint(): 0;
 }
 
 int MailQueue::SaveQueue(const char *filename) const 
 {
-    FILE *f = fopen(filename, "w");
+    char *tmp_filename = new char [strlen(filename) + 5];
+    sprintf(tmp_filename, "%s.tmp", filename);
+
+    FILE *f = fopen(tmp_filename, "w");
     if (f == 0) {
         write_log(
             "[SMTP-DAEMON] Can't open %s file to save mailqueue",
-            filename
+            tmp_filename
         );
 
+        delete [] tmp_filename;
         return -1;
     }
     
-    fprintf(f, "%d\n", message_count);
-    for (int i = 0; i < max_message_count; i++) {
-        if (message_list[i] != 0) {
+    fprintf(f, "%d\n", index.GetCount());
+    for (int i = 0; i < index.GetCapacity(); i++) {
+        QueueEntry *entry = index.GetEntry(i);
+        if (entry->message != 0) {
             fprintf(
                 f, 
-                "%s\n%s\n%s\n%ld\n", 
-                message_list[i]->GetId(), 
-                message_list[i]->GetInfoPath(), 
-                message_list[i]->GetDataPath(), 
-                (long int)message_list[i]->GetCreateTime()
+                "%s\n%s\n%ld\n%ld\n", 
+                entry->message->GetId(), 
+                entry->message->GetSpoolPath(), 
+                (long int)entry->message->GetCreateTime(),
+                (long int)entry->last_attempt
             );
             
         }
     }
+
+    int status = (fflush(f) || fsync(fileno(f))) ? -1: 0;
     fclose(f);
 
-    return 0;
+    if (!status)
+        status = rename(tmp_filename, filename);
+    if (status) {
+        write_log(
+            "[SMTP-DAEMON] Can't write %s mailqueue checkpoint\n",
+            filename
+        );
+        remove(tmp_filename);
+    }
+    delete [] tmp_filename;
+
+    return status;
 }
 
+long MailQueue::GetIdleTimeout() const
+{
+    long timeout = journal.GetSyncTimeout();
 
+    // due entries wait anyway while every delivery slot is taken
+    if (CanStartDeliveries())
+        timeout = merge_timeout(timeout, index.GetNextRun());
 
-char** MailQueue::GetDomains(
-    char **recipients_address, 
-    int recipients_count,
-    int *domains_count
-)
-{
-    char **domains = new char* [recipients_count];
-    *domains_count = 0;
-    
-    for (int i = 0; i < recipients_count; i++) {
-        int atpos = Message::FindAtSymbolInAddress(recipients_address[i]);
-        
-        bool is_new_domain = 1;
-        for (int j = 0; j < *domains_count; j++) {
-            if (!strcmp(domains[j], recipients_address[i] + atpos + 1)) {
-                is_new_domain = 0;
-                break;
-            }
-        }
-        
-        if (is_new_domain)
-            domains[(*domains_count)++] = strdup(recipients_address[i] + atpos + 1);
-    }
-    
-    return domains;
+    timeout = merge_timeout(timeout, dns_mx_resolver.GetNextDeadline());
+    timeout = merge_timeout(timeout, connection_cache.GetNextExpiry());
+    for (int i = 0; i < delivery_count; i++)
+        timeout = merge_timeout(timeout, deliveries[i]->GetDeadline());
+
+    return timeout;
 }
 
-/*
-int MailQueue::GetMXRecords(const char *name, char **mxs, int limit) 
+int MailQueue::FindMessageById(const char *id) const
 {
-    unsigned char response[NS_PACKETSZ]; 
-    ns_msg handle;
-    ns_rr rr;
-    int mx_index, ns_index, len;
-    char dispbuf[4096];
+    return index.Find(id);
+}
 
-    if ((len = res_search(name, C_IN, T_MX, response, sizeof(response))) < 0) {
-        // WARN: res_search failed
-        return -1;
-    }
+int MailQueue::InsertMessage(Message *message, time_t last_attempt)
+{
+    // the index grows as needed, messages already on disk are never
+    // dropped for lack of room
+    int idx = index.Insert(message, last_attempt);
+    ScheduleMessage(idx);
+    return idx;
+}
 
-    if (ns_initparse(response, len, &handle) < 0) {
-        // WARN: ns_initparse failed
-        return 0;
+void MailQueue::ScheduleMessage(int message_idx)
+{
+    QueueEntry *entry = index.GetEntry(message_idx);
+
+    // the same bounds HandleQueue used to check on every pass
+    time_t expire_time = entry->message->GetCreateTime() + lifetime + 1;
+    time_t attempt_time = entry->last_attempt ?
+        entry->last_attempt + sending_delay + 1: 0;
+
+    // the recipients know better once the record is loaded, records
+    // not loaded yet are looked at by the old rule and rescheduled
+    // when they turn out not to be due
+    if (entry->message->IsInfoLoaded()) {
+        time_t next_attempt = entry->message->GetNextAttempt();
+        if (next_attempt)
+            attempt_time = next_attempt;
     }
 
-    len = ns_msg_count(handle, ns_s_an);
-    if (len < 0)
-        return 0;
+    index.Schedule(
+        message_idx,
+        attempt_time < expire_time ? attempt_time: expire_time
+    );
+}
 
-    for (
-        mx_index = 0, ns_index = 0;
-        mx_index < limit && ns_index < len;
-        ns_index++
-    ) {
-        if (ns_parserr(&handle, ns_s_an, ns_index, &rr)) {
-            // WARN: ns_parserr failed
-            continue;
-        }
-        ns_sprintrr (&handle, &rr, NULL, NULL, dispbuf, sizeof (dispbuf));
-        if (ns_rr_class(rr) == ns_c_in && ns_rr_type(rr) == ns_t_mx) {
-            char mxname[MAXDNAME];
-            dn_expand(
-                ns_msg_base(handle),
-                ns_msg_base(handle) + ns_msg_size(handle),
-                ns_rr_rdata(rr) + NS_INT16SZ, 
-                mxname, 
-                sizeof(mxname)
-            );
-            mxs[mx_index++] = strdup(mxname);
-        }
+void MailQueue::RescheduleMessages()
+{
+    // messages with transactions running are unscheduled until the
+    // last one ends, FinishDelivery schedules them with the new values
+    for (int i = 0; i < index.GetCapacity(); i++) {
+        const QueueEntry *entry = index.GetEntry(i);
+        if (entry->message && entry->deliveries == 0)
+            ScheduleMessage(i);
     }
-    return mx_index;
 }
-*/
 
-//ADD CONST!!!!!!!!!!!!!!!!!!!!!
-in_addr* MailQueue::GetIPAddress(const char *name)
+time_t MailQueue::GetRetryDelay(int attempts, int defer) const
 {
-    //hostent *h = new hostent;
-    hostent *h = gethostbyname(name);
-    
-    in_addr **addr_list = (in_addr**)(h->h_addr_list);
-    
-    return addr_list[0];
+    time_t delay = defer == Message::defer_reply ?
+        reply_retry_delay: sending_delay;
+    if (delay <= 0)
+        delay = 1;
+
+    // doubled with every attempt, the first retry waits the base
+    for (int i = 1; i < attempts; i++) {
+        if (max_retry_delay > 0 && delay >= max_retry_delay)
+            break;
+        delay *= 2;
+    }
+    if (max_retry_delay > 0 && delay > max_retry_delay)
+        delay = max_retry_delay;
+
+    // a quarter either way, so messages that failed together do not
+    // come back together
+    time_t spread = delay / 2;
+    if (spread > 0)
+        delay += rand() % (spread + 1) - spread / 2;
+
+    return delay;
 }
 
-void MailQueue::DisconnectFromServer(int sock_fd) 
+bool MailQueue::CanStartDeliveries() const
 {
-    shutdown(sock_fd, 2);
-    close(sock_fd);
+    return limits.GetActiveCount() < max_delivery_count &&
+        delivery_count < k_max_waiting_factor * max_delivery_count;
 }
 
-int MailQueue::ConnectToServer(in_addr *server_address) 
+void MailQueue::AddDelivery(SMTPClientSession *session)
 {
-    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0)
-        return -1;
-    
-    sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(25);
-    addr.sin_addr = *server_address;
-    
-    if (0 != connect(sock_fd, (sockaddr*) &addr, sizeof(addr))) 
-        return -1;
-    
-    return sock_fd;
+    // the limit only holds back new messages, so every domain of the
+    // last message started gets its slot
+    if (delivery_count == deliveries_size) {
+        deliveries_size *= 2;
+        SMTPClientSession **new_deliveries = 
+            new SMTPClientSession* [deliveries_size];
+        memcpy(
+            new_deliveries, 
+            deliveries, 
+            delivery_count * sizeof(SMTPClientSession*)
+        );
+        delete [] deliveries;
+        deliveries = new_deliveries;
+    }
+
+    deliveries[delivery_count++] = session;
 }
 
+void MailQueue::FinishDelivery(SMTPClientSession *session, time_t curtime)
+{
+    Message *message = session->GetMessage();
+
+    bool settled = false;
+    for (int i = 0; i < session->GetRecipientsCount(); i++) {
+        int idx = session->GetRecipient(i);
+        int status = session->GetRecipientStatus(i);
+        message->SetRecipientStatus(idx, status, curtime);
+        if (status != Message::rcpt_pending)
+            settled = true;
+
+        if (status == Message::rcpt_pending) {
+            message->SetRecipientRetry(
+                idx,
+                curtime + GetRetryDelay(
+                    message->GetRecipientState(idx)->attempts,
+                    session->GetRecipientDefer(i)
+                )
+            );
+        }
+    }
+
+    if (session->IsDelivered()) {
+        write_log(
+            "[SMTP-DAEMON] Message %s sent to %s (%d socket calls)\n",
+            message->GetId(),
+            session->GetDomain(),
+            session->GetSyscallCount()
+        );
+    }
+
+    int message_idx = FindMessageById(message->GetId());
+    QueueEntry *entry = index.GetEntry(message_idx);
+    if (--entry->deliveries > 0) {
+        // the other domains of the message may take much longer, the
+        // recipients done with are kept now so that a restart in the
+        // meantime does not send to them again
+        if (settled)
+            message->WriteRecipientStates();
+        return;
+    }
 
+    // that was the last transaction of this attempt
+    message->WriteRecipientStates();
+    message->ClearData();
 
-int MailQueue::SendInfo(
-    int sock_fd,
-    const char *domain, const char *c_domain,
-    const char *sender_address,
-    char **recipients_address, int recipients_count
-) 
-{ 
-    if (WriteCommandToSocket(sock_fd, "HELO", domain) < 0)
-        return -1;
-    
-    
-    if (WriteAddressToSocket(sock_fd, "MAIL FROM:", sender_address) < 0)
-        return -1;
-    
-    for (int j = 0; j < recipients_count; j++) {
-        int atpos = Message::FindAtSymbolInAddress(recipients_address[j]);
-        if (!strcmp(recipients_address[j] + atpos + 1, c_domain)) {
-            if (WriteAddressToSocket(sock_fd, "RCPT TO:", recipients_address[j]) < 0)
-                return -1;
-        }
+    if (message->GetPendingRecipientsCount() == 0) {
+        write_log(
+            "[SMTP-DAEMON] Message %s send completely done, message removed from queue\n",
+            message->GetId()
+        );
+        DeleteMessageFromQueue(message_idx);
+        return;
     }
-    return 0;
-}
 
-int MailQueue::SendData(int sock_fd, const char *message_id, InoutBuffer *data) 
-{
-    if (WriteCommandToSocket(sock_fd, "DATA", 0) < 0)
-        return -1;
-    
-    /*
-    time_t cur_time;
-    time(&cur_time);
-    const char *date = ctime(&cur_time);
-    
-    WriteToSocket(sock_fd, "Date: ", 6);
-    WriteToSocket(sock_fd, date, strlen(date) - 1);
-    //WriteToSocket(sock_fd, "\r\nMessage-ID: ", 14);
-    WriteToSocket(sock_fd, "\nMessage-ID: ", 13);
-    WriteToSocket(sock_fd, message_id, strlen(message_id));
-    //WriteToSocket(sock_fd, "\r\n", 2);
-    WriteToSocket(sock_fd, "\n", 1);
-    */
-    /*
-    InoutBuffer curline;
-    while(data->ReadLine(curline)) {
-        WriteToSocket(sock_fd, curline.GetBuffer(), curline.Length());
-        //write_log("[SMTP-DAEMON] curline = (%s)\n", curline.GetBuffer());
-        //WriteToSocket(sock_fd, "\r\n", 2);
-        WriteToSocket(sock_fd, "\n", 1);
-    }
-    */
-    WriteToSocket(sock_fd, data->GetBuffer(), data->Length());
-
-    WriteToSocket(sock_fd, "\r\n.\r\n", 5);
-    
-    return GetReply(sock_fd) < 0 ? -1: 0;
-}
+    write_log(
+        "[SMTP-DAEMON] Message %s send partial done\n",
+        message->GetId()
+    );
 
-void MailQueue::WriteToSocket(int sock_fd, const char *msg, int msg_size) 
-{ 
-    write(sock_fd, msg, msg_size);
+    entry->last_attempt = curtime;
+    journal.AppendAttempt(message->GetId(), curtime);
+    ScheduleMessage(message_idx);
 }
 
-int MailQueue::WriteCommandToSocket(
-    int sock_fd,
-    const char *comm, const char *msg
-) 
+void MailQueue::DropMessage(int message_idx)
 {
-    write(sock_fd, comm, strlen(comm));
-    if (msg) {
-        write(sock_fd, " ", 1);
-        write(sock_fd, msg, strlen(msg));
-    }
-    write(sock_fd, "\r\n", 2);
-    
-    return GetReply(sock_fd);
+    // the index hashes the id to unlink the entry
+    Message *message = index.GetEntry(message_idx)->message;
+    index.Remove(message_idx);
+    delete message;
 }
 
-int MailQueue::WriteAddressToSocket(
-    int sock_fd, 
-    const char *comm, const char *addr
-) 
+int MailQueue::Recover()
 {
-    write(sock_fd, comm, strlen(comm));
-    write(sock_fd, " <", 2);
-    write(sock_fd, addr, strlen(addr));
-    write(sock_fd, ">\r\n", 3);
-    
-    return GetReply(sock_fd);
-}
+    struct timeval start, end;
+    gettimeofday(&start, 0);
 
-int MailQueue::GetReply(int sock_fd) 
-{ 
-    int len, result = 0;
-    char *data = new char [512];
+    QueueRecovery recovery(
+        server_options.queue_dir,
+        server_options.recovery_threads
+    );
+    recovery.Run();
 
-    len = read(sock_fd, data, 511);
-    data[len] = '\0';
+    int found_count = recovery.GetMessageCount();
+    bool *found = new bool [found_count > 0 ? found_count: 1];
+    memset(found, 0, found_count * sizeof(bool));
 
-    if (len > 0)
-        result = (data[0] == '2') || (data[0] == '3') ? 0: -1;
-    
-    delete[] data;
-    
-    return result;
+    // queue entries whose record is gone or was quarantined
+    int dropped = 0;
+    for (int i = 0; i < index.GetCapacity(); i++) {
+        Message *message = index.GetEntry(i)->message;
+        if (!message)
+            continue;
+
+        int rec_idx = recovery.FindMessage(message->GetId());
+        if (rec_idx >= 0) {
+            found[rec_idx] = true;
+            continue;
+        }
+
+        // the walk skips anything outside the buckets, those are
+        // checked one by one
+        SpoolRecordInfo info;
+        int status = Message::VerifySpoolFile(
+            message->GetSpoolPath(), &info
+        );
+        if (status > 0) {
+            free((void*)info.id);
+            continue;
+        }
+
+        write_log(
+            "[SMTP-DAEMON] Message %s dropped, its spool file %s is missing\n",
+            message->GetId(),
+            message->GetSpoolPath()
+        );
+        DropMessage(i);
+        dropped++;
+    }
+
+    // records the checkpoint and the journal know nothing about
+    int recovered = 0;
+    for (int i = 0; i < found_count; i++) {
+        if (found[i])
+            continue;
+
+        const RecoveredMessage *rec = recovery.GetMessage(i);
+        Message *message = new Message(
+            rec->id, rec->spool_path, rec->create_time
+        );
+        if (message->ReadInfoFile() < 0) {
+            delete message;
+            continue;
+        }
+
+        // the server went down between the spool commit and AddMessage,
+        // the local recipients have not been delivered to yet
+        DeliverLocal(message);
+        message->ClearData();
+        if (message->GetPendingRecipientsCount() == 0) {
+            message->DeleteMessage();
+            delete message;
+            recovered++;
+            continue;
+        }
+        message->WriteRecipientStates();
+
+        if (InsertMessage(message, rec->last_attempt) < 0)
+            delete message;
+        else
+            recovered++;
+    }
+    delete [] found;
+
+    gettimeofday(&end, 0);
+    write_log(
+        "[SMTP-DAEMON] Spool recovery: %d records checked by %d threads "
+        "in %ld ms, %d recovered, %d dropped, %d quarantined, "
+        "%d finished, %d leftovers removed\n",
+        recovery.GetCheckedCount(),
+        server_options.recovery_threads,
+        (end.tv_sec - start.tv_sec) * 1000 +
+            (end.tv_usec - start.tv_usec) / 1000,
+        recovered,
+        dropped,
+        recovery.GetQuarantinedCount(),
+        recovery.GetFinishedCount(),
+        recovery.GetRemovedCount()
+    );
+
+    return recovered + dropped;
 }
 
+int MailQueue::Checkpoint()
+{
+    // the journal is only cut once the checkpoint is durable
+    if (SaveQueue(queue_filename) < 0)
+        return -1;
 
+    return journal.Reset();
+}
 
 
 
+char** MailQueue::GetDomains(
+    char **recipients_address, 
+    int recipients_count,
+    int *domains_count
+)
+{
+    char **domains = new char* [recipients_count];
+    *domains_count = 0;
+    
+    for (int i = 0; i < recipients_count; i++) {
+        int atpos = Message::FindAtSymbolInAddress(recipients_address[i]);
+        
+        bool is_new_domain = 1;
+        for (int j = 0; j < *domains_count; j++) {
+            if (!strcmp(domains[j], recipients_address[i] + atpos + 1)) {
+                is_new_domain = 0;
+                break;
+            }
+        }
+        
+        if (is_new_domain)
+            domains[(*domains_count)++] = strdup(recipients_address[i] + atpos + 1);
+    }
+    
+    return domains;
+}
@@ -3,10 +3,36 @@
 
 #include "buffer.h"
 #include "userlist.h"
+#include "mimeindex.h"
+#include "queuejournal.h"
+#include "queueindex.h"
+#include "smtpclient.h"
+#include "mailboxcache.h"
+#include "maildir.h"
 
 #include <time.h>
 #include <stdio.h>
-#include <arpa/inet.h>
+#include <sys/select.h>
+
+struct RecipientState
+{
+    int status;
+    int attempts;
+    time_t last_attempt;
+    time_t next_attempt;
+
+    //Changed since the spool record was written
+    bool dirty;
+};
+
+//What the startup recovery learns from a spool record on its own
+struct SpoolRecordInfo
+{
+    char *id;
+    time_t create_time;
+    time_t last_attempt;
+    int pending_count;
+};
 
 class Message 
 {
@@ -16,26 +42,53 @@ class Message
     //Message data
     char *sender_address, **recipients_address;
     int recipients_count;
+    RecipientState *recipients_state;
     InoutBuffer data;
 
-    //Path to where message is stored
-    char *data_path, *info_path;
+    //Read only mapping of the spool record once the data is loaded
+    //from disk, mapped_data points at the body inside it
+    char *data_map;
+    long data_map_length;
+    const char *mapped_data;
+
+    //Path to where message is stored, envelope and data in one record
+    char *spool_path;
+    //MIME structure sidecar, lives next to the spool file
+    char *mime_path;
+
+    //Location of the data inside the spool record, -1 until known
+    long body_offset;
+    int body_length;
     
     //Time of the creation
     time_t create_time;
     
 public:
+    enum {
+        rcpt_pending = 0,
+        rcpt_delivered,
+        rcpt_failed
+    };
+
+    //Why a pending recipient was not delivered, picks its backoff
+    enum {
+        //no answer: lookup, connect, timeout or dropped connection
+        defer_connection = 0,
+        //the server answered 4xx, greylisting or a full mailbox
+        defer_reply
+    };
+
     Message(
         const char *an_id,
         const char *a_sender_address,
         char **a_recipients_address,
         int a_recipients_count,
-        const InoutBuffer *a_data
+        const char *a_data,
+        int a_data_length
     );
     Message(
         const char *an_id,
-        const char *an_info_path, 
-        const char *a_data_path,
+        const char *a_spool_path,
         time_t a_create_time
     );
     
@@ -47,9 +100,22 @@ public:
     const char* GetSenderAddress() const;
     int GetRecipientsCount() const;
     char **GetRecipientsAddress();
-    const InoutBuffer* GetData() const;
-    const char* GetDataPath() const;
-    const char* GetInfoPath() const;
+    int GetRecipientStatus(int idx) const;
+    const RecipientState* GetRecipientState(int idx) const;
+    int GetPendingRecipientsCount() const;
+    //Pending and its retry time has come
+    bool IsRecipientDue(int idx, time_t now) const;
+    //Earliest retry time of the pending recipients, 0 if one of them
+    //has none
+    time_t GetNextAttempt() const;
+    //The data is kept in wire format: CRLF line ends, dot-stuffed
+    const char* GetData() const;
+    int GetDataLength() const;
+    //Location of the data inside the spool record
+    long GetBodyOffset() const;
+    int GetBodyLength() const;
+    const char* GetSpoolPath() const;
+    const char* GetMimePath() const;
     time_t GetCreateTime() const;
     
     bool IsInfoLoaded() const;
@@ -58,35 +124,75 @@ public:
     static char* GenerateMessageId(const char *domain);
     
     static int FindAtSymbolInAddress(const char *address);
+
+    //Converts received data to the form it is spooled and sent in
+    static void MakeWireData(const char *src, int len, InoutBuffer &wire);
+    //And back to the form mailboxes keep: LF line ends, no stuffing
+    static void MakeMailboxData(const char *src, int len, InoutBuffer &box);
     
     int ReadDataFile();
+    //Drops the data kept in memory or mapped, the record keeps it
+    void ClearData();
     int ReadInfoFile();
                                     
     static char* ReadLineFromFile(FILE *f, int &len);
-    
-    void ReplaceInfo(
-        const char *a_sender_address, 
-        char **a_recipients_address, 
-        int a_recipients_count
+
+    //Counts as a delivery attempt when attempt_time is not 0
+    void SetRecipientStatus(int idx, int status, time_t attempt_time);
+    void SetRecipientRetry(int idx, time_t next_attempt);
+    //Overwrites the entries of the changed recipients inside the
+    //spool record, the rest of the record is left as it is
+    int WriteRecipientStates();
+
+    //Writes the whole record into <spool_path>.tmp and returns
+    //the open descriptor, the caller syncs and renames it
+    //(data and info should exist)
+    int WriteTempSpoolFile();
+    //Writes, syncs and renames the record in place right away
+    int GenerateSpoolFile();
+
+    //Creates the <queue_dir>/XX/YY buckets, called once at startup
+    static int PrepareSpoolDirectories();
+    //Reads and checks the envelope of a record without loading it,
+    //1 if it is valid (info->id is malloc'ed), -1 if it is corrupted
+    static int VerifySpoolFile(const char *path, SpoolRecordInfo *info);
+    //Moves a record spooled under an older layout into its bucket,
+    //returns 1 if it was moved
+    int MoveToSpoolLayout();
+    //Turns an info.txt/data.txt pair of the first queue format into
+    //a spool record and removes the pair, 0 if it can't be read; the
+    //aliases among its recipients are expanded as at RCPT time
+    static Message* ImportTextFiles(
+        const char *an_id,
+        const char *an_info_path,
+        const char *a_data_path,
+        time_t a_create_time,
+        const UserList *user_list
     );
 
-    //data should exist
-    int GenerateDataFile() const;
-    //info should exist
-    int GenerateInfoFile() const;
+    int GenerateMimeIndexFile(const MimeIndex *mime_index) const;
+    int ReadMimeIndexFile(MimeIndex *mime_index) const;
     
 private:
-    char* GenerateDataPath() const;
-    char* GenerateInfoPath() const;
-    char* GenerateCommonPath(int &len) const;
+    char* GenerateSpoolPath() const;
+    static char* GenerateMimePath(const char *a_spool_path);
+    static unsigned int GetSpoolHash(const char *an_id);
+
+    int ParseSpoolRecord(const char *record, long size);
+    //Writes the record of an imported message, its data in mailbox form
+    int ConvertSpoolFile();
+    //Replaces local recipients by where their mail ends up
+    void ExpandAliases(const UserList *user_list);
     
     static long unsigned int GetTimeValue(const struct tm *timeinfo);
     static long unsigned int GetRandValue(int size);
     
     static void MakeDir(const char *dir);
+    //Removes the empty directories the file at path was in, up to
+    //the queue directory
+    static void PruneOldDirectories(const char *path);
 
     void ClearInfo();
-    void ClearData();
 };
 
 class MailQueue 
@@ -94,13 +200,34 @@ class MailQueue
     char *domain;
     const UserList *user_list;
     
-    Message **message_list;
-    time_t *last_send_attempt;
-    int message_count, max_message_count;
+    QueueIndex index;
+    //Limit for new mail coming into the queue, 0 for none
+    int max_message_count;
     
     time_t lifetime, sending_delay;
+    //Backoff bases for recipients deferred by a 4xx reply and for the
+    //ones that got no answer (sending_delay), and its upper bound
+    time_t reply_retry_delay, max_retry_delay;
     
     char *queue_filename;
+    QueueJournal journal;
+
+    //Outbound transactions in flight, new messages are started only
+    //while fewer than max_delivery_count of them are past waiting
+    //for a free slot of their destination
+    SMTPClientSession **deliveries;
+    int delivery_count, deliveries_size;
+    int max_delivery_count;
+    DeliveryLimits limits;
+    ConnectionCache connection_cache;
+    //Sessions waiting for a slot of their destination, by domain
+    DomainQueue domain_queue;
+    DestinationHealth health;
+    //Smarthosts to relay through, none unless configured
+    RelayHosts relay;
+    MailboxCache mailboxes;
+    //Users' mail paths are Maildirs instead of mailbox files
+    bool use_maildir;
     
 public:
     MailQueue(
@@ -114,15 +241,31 @@ public:
     
     int AddMessage(Message *message);
     int DeleteMessageFromQueue(int message_idx);
+    //Delivers to the pending recipients in our own domain, they get
+    //their final status right away
+    void DeliverLocal(Message *message);
     
+    //mailbox_data is the message data in mailbox form, it is made
+    //on the first local delivery and reused for the other recipients,
+    //the same goes for the Maildir copy
     int DeliverMessage(
         Message *message, 
         const char *sender_address, 
-        const char *recipient_address
+        const char *recipient_address,
+        InoutBuffer &mailbox_data,
+        MaildirDelivery &maildir
     );
+    //Starts a transaction for every domain with pending recipients,
+    //or one for all of them when relaying, returns their number or
+    //-1 if the message could not be read
     int SendMessage(int message_idx);
     
     void HandleQueue();
+
+    //Adds the sockets of the outbound transactions and the resolver
+    void GetDeliveryFds(fd_set &read_fds, fd_set &write_fds, int &max_fd) const;
+    //Moves the transactions on and settles the finished ones
+    void HandleDeliveries(const fd_set &read_fds, const fd_set &write_fds);
     
     int GetMessageCount() const;
     int GetMaxMessageCount() const;
@@ -132,43 +275,35 @@ public:
     
     int LoadQueue(const char *filename);
     int SaveQueue(const char *filename) const;
+
+    //Milliseconds until HandleQueue has pending work, -1 if none
+    long GetIdleTimeout() const;
     
 private:
+    int FindMessageById(const char *id) const;
+    int InsertMessage(Message *message, time_t last_attempt);
+    //Puts the message in the schedule for its next attempt or expiry
+    void ScheduleMessage(int message_idx);
+    void RescheduleMessages();
+    //Takes the message out of the index and deletes the object only
+    void DropMessage(int message_idx);
+    int Checkpoint();
+    //Cross-checks the loaded queue against the records on disk
+    int Recover();
+
+    //Backoff of a recipient deferred for the attempts-th time
+    time_t GetRetryDelay(int attempts, int defer) const;
+    bool CanStartDeliveries() const;
+    void AddDelivery(SMTPClientSession *session);
+    //Records the outcome and, after the last transaction of the
+    //message, removes it or schedules the next attempt
+    void FinishDelivery(SMTPClientSession *session, time_t curtime);
+
     static char** GetDomains(
         char **recipients_address, 
         int recipients_count, 
         int *domains_count
     );
-    //static int GetMXRecords(const char *name, char **mxs, int limit);
-    static in_addr* GetIPAddress(const char *name);
-    
-    static void DisconnectFromServer(int sock_fd);
-    static int ConnectToServer(in_addr *server_address);
-    
-    static int SendInfo(
-        int sock_fd,
-        const char *domain, const char *c_domain,
-        const char *sender_address, 
-        char **recipients_address, int recipients_count
-    );
-    static int SendData(
-        int sock_fd, 
-        const char* message_id, 
-        InoutBuffer *data
-    );
-        
-    static void WriteToSocket(int sock_fd, const char *msg, int msg_size);
-    static int WriteCommandToSocket(
-        int sock_fd,
-        const char *comm, 
-        const char *msg
-    );
-    static int WriteAddressToSocket(
-        int sock_fd, 
-        const char *comm, 
-        const char *addr
-    );
-    static int GetReply(int sock_fd);
 };
 
 #endif
@@ -9,6 +9,7 @@
 #include "options.h"
 #include "header.h"
 #include "resolve.h"
+#include "spoolcommit.h"
 
 int (*init_func)() = 0;
 void (*main_func)() = 0;
@@ -21,6 +22,7 @@ DNSMXResolver dns_mx_resolver;
 UserList *user_list = 0;
 MailQueue *mail_queue = 0;
 MailServer *mail_server = 0;
+SpoolCommitter *spool_committer = 0;
 IPAddressList *initial_white_list = 0, *white_list = 0, *gray_list = 0, *black_list = 0;
 
 int Initialize() 
@@ -45,6 +47,13 @@ int Initialize()
         server_options.max_messages, 
         user_list
     );
+    if (mail_queue->LoadQueue(server_options.queue_file))
+        return -1;
+
+    spool_committer = new SpoolCommitter(server_options.group_commit_delay);
+    if (spool_committer->Start())
+        return -1;
+
     mail_server = new MailServer(
         server_options.domain, 
         server_options.smtp_port, 
@@ -83,13 +92,35 @@ void MainLoop()
     fd_set read_fds = mail_server->GetReadFds();
     int max_fd = mail_server->GetMaxFd();
 
-    int res = select(max_fd + 1, &read_fds, 0, 0, 0);
+    int commit_fd = spool_committer->GetNotifyFd();
+    FD_SET(commit_fd, &read_fds);
+    if (commit_fd > max_fd)
+        max_fd = commit_fd;
+
+    fd_set write_fds;
+    FD_ZERO(&write_fds);
+    mail_queue->GetDeliveryFds(read_fds, write_fds, max_fd);
+
+    // wake up in time for the queue's pending work (journal fsync,
+    // the next due retry or expiry, delivery timeouts)
+    struct timeval t_select, *t_select_ptr = 0;
+    long idle_timeout = mail_queue->GetIdleTimeout();
+    if (idle_timeout >= 0) {
+        t_select.tv_sec = idle_timeout / 1000;
+        t_select.tv_usec = (idle_timeout % 1000) * 1000;
+        t_select_ptr = &t_select;
+    }
+
+    int res = select(max_fd + 1, &read_fds, &write_fds, 0, t_select_ptr);
 
     if (res < 0) {
         write_log("[SMTP-DAEMON] select() failed\n(%s)\n", strerror(errno));
         exit(CHILD_NEED_WORK);
     }
 
+    if (FD_ISSET(commit_fd, &read_fds))
+        mail_server->HandleCommittedMessages();
+
     if (mail_server->HaveNewConnection(read_fds)) {
         const char *ip_address = mail_server->ConnectUser();
 
@@ -146,6 +177,7 @@ void MainLoop()
         mail_server->HandleOutData(idx);
     }
     
+    mail_queue->HandleDeliveries(read_fds, write_fds);
     mail_queue->HandleQueue();
 
     gray_list->MoveRecordsToSpam(black_list);
@@ -154,6 +186,13 @@ void MainLoop()
 
 void Finalize() 
 {
+    // let the last batch land in the queue before it goes away
+    if (spool_committer) {
+        spool_committer->Stop();
+        if (mail_server && mail_queue)
+            mail_server->HandleCommittedMessages();
+    }
+
     if (user_list)
         delete user_list;
     
@@ -161,6 +200,8 @@ void Finalize()
         delete mail_queue;
     if (mail_server)
         delete mail_server;
+    if (spool_committer)
+        delete spool_committer;
 
     if (initial_white_list)
         delete initial_white_list;
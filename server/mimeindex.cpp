@@ -0,0 +1,416 @@
+#include "mimeindex.h"
+#include "daemon.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include <stdint.h>
+
+struct MimeIndexFileHeader
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t part_count;
+};
+
+#pragma pack(push, 1)
+struct MimeIndexFileRecord
+{
+    uint32_t header_offset;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t depth;
+    uint8_t encoding;
+    uint8_t is_multipart;
+    uint8_t content_type_len;
+};
+#pragma pack(pop)
+
+static const char k_mime_index_magic[4] = {'M', 'I', 'D', 'X'};
+
+static void append_value(char *dst, const char *src, int src_len, int max_len)
+{
+    int len = strlen(dst);
+    if (len + src_len >= max_len)
+        src_len = max_len - len - 1;
+    if (src_len <= 0)
+        return;
+    memcpy(dst + len, src, src_len);
+    dst[len + src_len] = '\0';
+}
+
+
+MimeIndex::MimeIndex()
+{
+    part_count = 0;
+    max_part_count = 8;
+    parts = new MimePart [max_part_count];
+}
+
+MimeIndex::~MimeIndex()
+{
+    delete [] parts;
+}
+
+
+
+void MimeIndex::Build(const char *data, int len)
+{
+    Clear();
+
+    enum { hdr_none, hdr_content_type, hdr_encoding } collecting = hdr_none;
+    char content_type[K_MAX_VALUE_SIZE], encoding[K_MAX_VALUE_SIZE];
+    content_type[0] = encoding[0] = '\0';
+
+    MultipartLevel levels[K_MAX_DEPTH];
+    int level_count = 0;
+
+    // the message header is the header of the top-level part
+    int cur = AddPart(0, 0);
+    bool in_headers = true;
+
+    int pos = 0;
+    while (pos < len) {
+        const char *line = data + pos;
+        const char *nl = (const char*)memchr(line, '\n', len - pos);
+        int line_len = nl ? nl - line : len - pos;
+        int next = nl ? pos + line_len + 1 : len;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line_len--;
+
+        if (in_headers) {
+            if (line_len == 0) {
+                char boundary[K_MAX_BOUNDARY_SIZE];
+                ParseContentType(content_type, &parts[cur], boundary);
+                parts[cur].encoding = ParseEncoding(encoding);
+                parts[cur].offset = next;
+                in_headers = false;
+
+                if (parts[cur].is_multipart && level_count < K_MAX_DEPTH) {
+                    MultipartLevel *level = &levels[level_count++];
+                    strcpy(level->boundary, boundary);
+                    level->boundary_len = strlen(boundary);
+                    level->part_idx = cur;
+                } else {
+                    parts[cur].is_multipart = false;
+                }
+
+                collecting = hdr_none;
+                content_type[0] = encoding[0] = '\0';
+            } else if (line[0] == ' ' || line[0] == '\t') {
+                if (collecting == hdr_content_type)
+                    append_value(content_type, line, line_len, K_MAX_VALUE_SIZE);
+                else if (collecting == hdr_encoding)
+                    append_value(encoding, line, line_len, K_MAX_VALUE_SIZE);
+            } else {
+                const char *colon = (const char*)memchr(line, ':', line_len);
+                int value_len = colon ? line_len - (colon - line) - 1 : 0;
+
+                if (IsHeaderName(line, line_len, "Content-Type")) {
+                    collecting = hdr_content_type;
+                    content_type[0] = '\0';
+                    append_value(content_type, colon + 1, value_len, K_MAX_VALUE_SIZE);
+                } else if (IsHeaderName(line, line_len, "Content-Transfer-Encoding")) {
+                    collecting = hdr_encoding;
+                    encoding[0] = '\0';
+                    append_value(encoding, colon + 1, value_len, K_MAX_VALUE_SIZE);
+                } else {
+                    collecting = hdr_none;
+                }
+            }
+            pos = next;
+            continue;
+        }
+
+        int matched = 0, k;
+        if (line_len >= 2 && line[0] == '-' && line[1] == '-') {
+            for (k = level_count - 1; k >= 0; k--) {
+                if ((matched = MatchBoundary(line, line_len, &levels[k])))
+                    break;
+            }
+        }
+
+        if (!matched) {
+            pos = next;
+            continue;
+        }
+
+        // the line break before a delimiter belongs to the delimiter
+        int end = pos;
+        if (end > 0 && data[end - 1] == '\n')
+            end--;
+        if (end > 0 && data[end - 1] == '\r')
+            end--;
+
+        if (cur >= 0 && cur != levels[k].part_idx && end >= parts[cur].offset)
+            parts[cur].length = end - parts[cur].offset;
+        for (int j = level_count - 1; j > k; j--) {
+            MimePart *container = &parts[levels[j].part_idx];
+            if (end >= container->offset)
+                container->length = end - container->offset;
+        }
+        level_count = k + 1;
+
+        if (matched == 2) {
+            // closing delimiter, anything up to the next parent
+            // delimiter is an epilogue and is not indexed
+            MimePart *container = &parts[levels[k].part_idx];
+            container->length = pos + line_len - container->offset;
+            level_count = k;
+            cur = -1;
+        } else if (part_count >= K_MAX_PARTS) {
+            write_log("[SMTP-DAEMON] MIME index truncated, too many parts\n");
+            cur = -1;
+            break;
+        } else {
+            cur = AddPart(next, k + 1);
+            in_headers = true;
+        }
+        pos = next;
+    }
+
+    if (cur >= 0) {
+        if (in_headers)
+            parts[cur].offset = len;
+        parts[cur].length = len - parts[cur].offset;
+    }
+    for (int j = level_count - 1; j >= 0; j--) {
+        MimePart *container = &parts[levels[j].part_idx];
+        container->length = len - container->offset;
+    }
+    parts[0].length = len - parts[0].offset;
+}
+
+void MimeIndex::Clear()
+{
+    part_count = 0;
+}
+
+int MimeIndex::GetPartCount() const { return part_count; }
+
+const MimePart* MimeIndex::GetPart(int idx) const
+{
+    if ((idx < 0) || (idx >= part_count))
+        return 0;
+
+    return &parts[idx];
+}
+
+
+
+int MimeIndex::Save(const char *path) const
+{
+    FILE *f = fopen(path, "w");
+    if (f == 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't open %s file to save MIME index\n",
+            path
+        );
+        return -1;
+    }
+
+    MimeIndexFileHeader header;
+    memcpy(header.magic, k_mime_index_magic, sizeof(header.magic));
+    header.version = K_VERSION;
+    header.part_count = part_count;
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (int i = 0; i < part_count; i++) {
+        MimeIndexFileRecord rec;
+        rec.header_offset = parts[i].header_offset;
+        rec.offset = parts[i].offset;
+        rec.length = parts[i].length;
+        rec.depth = parts[i].depth;
+        rec.encoding = parts[i].encoding;
+        rec.is_multipart = parts[i].is_multipart;
+        rec.content_type_len = strlen(parts[i].content_type);
+
+        fwrite(&rec, sizeof(rec), 1, f);
+        fwrite(parts[i].content_type, rec.content_type_len, 1, f);
+    }
+
+    int status = ferror(f) ? -1: 0;
+    fclose(f);
+
+    return status;
+}
+
+int MimeIndex::Load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == 0)
+        return -1;
+
+    Clear();
+
+    MimeIndexFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, k_mime_index_magic, sizeof(header.magic)) ||
+        header.version != K_VERSION) {
+        fclose(f);
+        return -1;
+    }
+
+    for (int i = 0; i < header.part_count; i++) {
+        MimeIndexFileRecord rec;
+        if (fread(&rec, sizeof(rec), 1, f) != 1 ||
+            rec.content_type_len >= K_MAX_CONTENT_TYPE_SIZE) {
+            Clear();
+            fclose(f);
+            return -1;
+        }
+
+        MimePart *part = &parts[AddPart(rec.header_offset, rec.depth)];
+        part->offset = rec.offset;
+        part->length = rec.length;
+        part->encoding = rec.encoding;
+        part->is_multipart = rec.is_multipart;
+
+        if (rec.content_type_len &&
+            fread(part->content_type, rec.content_type_len, 1, f) != 1) {
+            Clear();
+            fclose(f);
+            return -1;
+        }
+        part->content_type[rec.content_type_len] = '\0';
+    }
+
+    fclose(f);
+    return 0;
+}
+
+
+
+int MimeIndex::AddPart(int header_offset, int depth)
+{
+    if (part_count >= max_part_count) {
+        MimePart *new_parts = new MimePart [max_part_count * 2];
+        memcpy(new_parts, parts, part_count * sizeof(MimePart));
+        delete [] parts;
+        parts = new_parts;
+        max_part_count *= 2;
+    }
+
+    MimePart *part = &parts[part_count];
+    part->header_offset = header_offset;
+    part->offset = header_offset;
+    part->length = 0;
+    part->depth = depth;
+    part->encoding = enc_7bit;
+    part->is_multipart = false;
+    strcpy(part->content_type, "text/plain");
+
+    return part_count++;
+}
+
+void MimeIndex::ParseContentType(
+    const char *value,
+    MimePart *part,
+    char *boundary
+)
+{
+    boundary[0] = '\0';
+
+    while (*value == ' ' || *value == '\t')
+        value++;
+    if (*value == '\0')
+        return;
+
+    int len = 0;
+    while (value[len] && value[len] != ';' &&
+        value[len] != ' ' && value[len] != '\t' &&
+        len < K_MAX_CONTENT_TYPE_SIZE - 1) {
+        part->content_type[len] = tolower(value[len]);
+        len++;
+    }
+    part->content_type[len] = '\0';
+
+    part->is_multipart = !strncmp(part->content_type, "multipart/", 10);
+    if (!part->is_multipart)
+        return;
+
+    for (const char *p = strchr(value, ';'); p; p = strchr(p + 1, ';')) {
+        const char *param = p + 1;
+        while (*param == ' ' || *param == '\t')
+            param++;
+        if (strncasecmp(param, "boundary=", 9))
+            continue;
+
+        param += 9;
+        bool quoted = (*param == '"');
+        if (quoted)
+            param++;
+
+        int blen = 0;
+        while (param[blen] && blen < K_MAX_BOUNDARY_SIZE - 1) {
+            if (quoted ? param[blen] == '"' :
+                (param[blen] == ';' || param[blen] == ' ' || param[blen] == '\t'))
+                break;
+            boundary[blen] = param[blen];
+            blen++;
+        }
+        boundary[blen] = '\0';
+        break;
+    }
+
+    if (boundary[0] == '\0')
+        part->is_multipart = false;
+}
+
+int MimeIndex::ParseEncoding(const char *value)
+{
+    while (*value == ' ' || *value == '\t')
+        value++;
+
+    if (*value == '\0' || !strncasecmp(value, "7bit", 4))
+        return enc_7bit;
+    if (!strncasecmp(value, "8bit", 4))
+        return enc_8bit;
+    if (!strncasecmp(value, "binary", 6))
+        return enc_binary;
+    if (!strncasecmp(value, "quoted-printable", 16))
+        return enc_quoted_printable;
+    if (!strncasecmp(value, "base64", 6))
+        return enc_base64;
+
+    return enc_other;
+}
+
+int MimeIndex::MatchBoundary(
+    const char *line, int line_len,
+    const MultipartLevel *level
+)
+{
+    if (line_len < level->boundary_len + 2 ||
+        memcmp(line + 2, level->boundary, level->boundary_len))
+        return 0;
+
+    int i = level->boundary_len + 2;
+    int result = 1;
+    if (line_len - i >= 2 && line[i] == '-' && line[i + 1] == '-') {
+        result = 2;
+        i += 2;
+    }
+
+    // only transport padding may follow the delimiter
+    for (; i < line_len; i++) {
+        if (line[i] != ' ' && line[i] != '\t')
+            return 0;
+    }
+
+    return result;
+}
+
+bool MimeIndex::IsHeaderName(
+    const char *line, int line_len,
+    const char *name
+)
+{
+    int name_len = strlen(name);
+    if (line_len <= name_len || line[name_len] != ':')
+        return false;
+
+    return !strncasecmp(line, name, name_len);
+}
@@ -0,0 +1,82 @@
+#ifndef MIMEINDEX_H_SENTRY
+#define MIMEINDEX_H_SENTRY
+
+enum {
+    K_MAX_CONTENT_TYPE_SIZE = 64
+};
+
+struct MimePart
+{
+    //Offsets are relative to the beginning of the message data
+    int header_offset;
+    int offset, length;
+
+    int depth;
+    int encoding;
+    bool is_multipart;
+
+    char content_type[K_MAX_CONTENT_TYPE_SIZE];
+};
+
+class MimeIndex
+{
+    enum {
+        K_MAX_DEPTH         = 16,
+        K_MAX_PARTS         = 4096,
+        K_MAX_BOUNDARY_SIZE = 80,
+        K_MAX_VALUE_SIZE    = 512,
+        K_VERSION           = 1
+    };
+
+    struct MultipartLevel {
+        char boundary[K_MAX_BOUNDARY_SIZE];
+        int boundary_len;
+        int part_idx;
+    };
+
+    MimePart *parts;
+    int part_count, max_part_count;
+
+public:
+    enum {
+        enc_7bit = 0,
+        enc_8bit,
+        enc_binary,
+        enc_quoted_printable,
+        enc_base64,
+        enc_other
+    };
+
+    MimeIndex();
+    ~MimeIndex();
+
+    //Single pass over the whole message (header and body)
+    void Build(const char *data, int len);
+    void Clear();
+
+    int GetPartCount() const;
+    const MimePart* GetPart(int idx) const;
+
+    int Save(const char *path) const;
+    int Load(const char *path);
+
+private:
+    int AddPart(int header_offset, int depth);
+
+    static void ParseContentType(
+        const char *value,
+        MimePart *part,
+        char *boundary
+    );
+    static int ParseEncoding(const char *value);
+    static int MatchBoundary(
+        const char *line, int line_len,
+        const MultipartLevel *level
+    );
+    static bool IsHeaderName(
+        const char *line, int line_len,
+        const char *name
+    );
+};
+
+#endif
@@ -27,12 +27,63 @@ int Options::Load(const char *filename)
     max_recipients = iniparser_getint(dict, "smtp:max_recipients", 20);
     max_message_size = iniparser_getint(dict, "smtp:max_message_size", 30000);
     mail_dir = iniparser_getstring(dict, "smtp:mail_dir", "");
+    mailbox_cache_size = iniparser_getint(
+        dict, "smtp:mailbox_cache_size", 64
+    );
+    mailbox_format = iniparser_getstring(
+        dict, "smtp:mailbox_format", "mbox"
+    );
 
     //write_log("%d %d (%s)\n", max_recipients, max_message_size, mail_dir);
 
     queue_dir = iniparser_getstring(dict, "queue:queue_dir", "");
     queue_file = iniparser_getstring(dict, "queue:queue_file", "");
-    max_messages = iniparser_getint(dict, "queue:max_messages", 15);
+    max_messages = iniparser_getint(dict, "queue:max_messages", 0);
+    journal_file = iniparser_getstring(dict, "queue:journal_file", "");
+    journal_fsync_batch = iniparser_getint(
+        dict, "queue:journal_fsync_batch", 32
+    );
+    journal_fsync_interval = iniparser_getint(
+        dict, "queue:journal_fsync_interval", 100
+    );
+    journal_compact_records = iniparser_getint(
+        dict, "queue:journal_compact_records", 10000
+    );
+    group_commit_delay = iniparser_getint(
+        dict, "queue:group_commit_delay", 2
+    );
+    recovery_threads = iniparser_getint(
+        dict, "queue:recovery_threads", 4
+    );
+    max_deliveries = iniparser_getint(dict, "queue:max_deliveries", 64);
+    max_domain_connections = iniparser_getint(
+        dict, "queue:max_domain_connections", 10
+    );
+    max_address_connections = iniparser_getint(
+        dict, "queue:max_address_connections", 5
+    );
+    connection_idle_time = iniparser_getint(
+        dict, "queue:connection_idle_time", 30
+    );
+    connection_max_messages = iniparser_getint(
+        dict, "queue:connection_max_messages", 100
+    );
+    connect_timeout = iniparser_getint(dict, "queue:connect_timeout", 30);
+    command_timeout = iniparser_getint(dict, "queue:command_timeout", 300);
+    data_timeout = iniparser_getint(dict, "queue:data_timeout", 600);
+    reply_retry_delay = iniparser_getint(
+        dict, "queue:reply_retry_delay", 300
+    );
+    max_retry_delay = iniparser_getint(dict, "queue:max_retry_delay", 14400);
+    circuit_failures = iniparser_getint(dict, "queue:circuit_failures", 5);
+    circuit_open_time = iniparser_getint(
+        dict, "queue:circuit_open_time", 300
+    );
+
+    relay_hosts = iniparser_getstring(dict, "relay:hosts", "");
+    relay_max_host_connections = iniparser_getint(
+        dict, "relay:max_host_connections", 10
+    );
 
     //write_log("(%s) (%s) %d\n", queue_dir, queue_file, max_messages);
 
@@ -16,10 +16,44 @@ public:
     int max_recipients;
     int max_message_size;
     const char *mail_dir;
+    //Local mailboxes kept open between deliveries
+    int mailbox_cache_size;
+    //"mbox" for one file per user, "maildir" for a Maildir per user
+    const char *mailbox_format;
     
     const char *queue_dir;
     const char *queue_file;
     int max_messages;
+    const char *journal_file;
+    int journal_fsync_batch;
+    int journal_fsync_interval;
+    int journal_compact_records;
+    int group_commit_delay;
+    int recovery_threads;
+    //Outbound transactions running at once and their timeouts (seconds)
+    int max_deliveries;
+    int max_domain_connections;
+    int max_address_connections;
+    //Seconds an outbound connection is kept idle for reuse, 0 for never
+    int connection_idle_time;
+    int connection_max_messages;
+    int connect_timeout;
+    int command_timeout;
+    int data_timeout;
+    //Retry backoff after a 4xx reply and its upper bound (seconds),
+    //failures without a reply start from the sending delay
+    int reply_retry_delay;
+    int max_retry_delay;
+    //Failures in a row after which a destination is skipped, 0 for
+    //never, and for how many seconds
+    int circuit_failures;
+    int circuit_open_time;
+
+    //Smarthosts all outbound mail goes through, "host[:port]" in a
+    //list, mail goes to the domains' exchanges when it is empty
+    const char *relay_hosts;
+    //Connections to one smarthost at once, 0 for no limit
+    int relay_max_host_connections;
 
     const char *init_whitelist_file;
     const char *whitelist_file;
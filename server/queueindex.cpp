@@ -0,0 +1,268 @@
+#include "queueindex.h"
+#include "mailqueue.h"
+#include "hash.h"
+
+#include <string.h>
+
+QueueIndex::QueueIndex()
+{
+    slabs = 0;
+    slab_count = max_slab_count = 0;
+
+    free_head = -1;
+    count = 0;
+
+    bucket_count = 1024;
+    buckets = new int [bucket_count];
+    for (int i = 0; i < bucket_count; i++)
+        buckets[i] = -1;
+
+    heap = 0;
+    heap_size = max_heap_size = 0;
+}
+
+QueueIndex::~QueueIndex()
+{
+    for (int i = 0; i < slab_count; i++)
+        delete [] slabs[i];
+    if (slabs)
+        delete [] slabs;
+
+    delete [] buckets;
+    if (heap)
+        delete [] heap;
+}
+
+
+
+int QueueIndex::Insert(Message *message, time_t last_attempt)
+{
+    if (free_head < 0)
+        AddSlab();
+
+    int handle = free_head;
+    QueueEntry *entry = GetEntry(handle);
+    free_head = entry->next_free;
+
+    entry->message = message;
+    entry->last_attempt = last_attempt;
+    entry->next_run = 0;
+    entry->heap_pos = -1;
+    entry->deliveries = 0;
+    entry->next_free = -1;
+
+    int bucket = GetBucket(message->GetId());
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = handle;
+
+    count++;
+    if (count > bucket_count)
+        Rehash(2 * bucket_count);
+
+    return handle;
+}
+
+void QueueIndex::Remove(int handle)
+{
+    QueueEntry *entry = GetEntry(handle);
+    if (!entry->message)
+        return;
+
+    Unschedule(handle);
+
+    int *link = &buckets[GetBucket(entry->message->GetId())];
+    while (*link != handle)
+        link = &GetEntry(*link)->hash_next;
+    *link = entry->hash_next;
+
+    entry->message = 0;
+    entry->last_attempt = 0;
+    entry->hash_next = -1;
+    entry->next_free = free_head;
+    free_head = handle;
+
+    count--;
+}
+
+int QueueIndex::Find(const char *id) const
+{
+    int handle = buckets[GetBucket(id)];
+    while (handle >= 0) {
+        QueueEntry *entry = GetEntry(handle);
+        if (!strcmp(entry->message->GetId(), id))
+            return handle;
+        handle = entry->hash_next;
+    }
+
+    return -1;
+}
+
+void QueueIndex::Schedule(int handle, time_t when)
+{
+    QueueEntry *entry = GetEntry(handle);
+    time_t old_run = entry->next_run;
+    entry->next_run = when;
+
+    if (entry->heap_pos < 0) {
+        if (heap_size == max_heap_size) {
+            max_heap_size = max_heap_size ? 2 * max_heap_size: K_SLAB_SIZE;
+            int *new_heap = new int [max_heap_size];
+            if (heap) {
+                memcpy(new_heap, heap, heap_size * sizeof(int));
+                delete [] heap;
+            }
+            heap = new_heap;
+        }
+
+        PlaceInHeap(heap_size++, handle);
+        SiftUp(entry->heap_pos);
+    } else if (when < old_run) {
+        SiftUp(entry->heap_pos);
+    } else {
+        SiftDown(entry->heap_pos);
+    }
+}
+
+void QueueIndex::Unschedule(int handle)
+{
+    QueueEntry *entry = GetEntry(handle);
+    int pos = entry->heap_pos;
+    if (pos < 0)
+        return;
+
+    entry->heap_pos = -1;
+    heap_size--;
+    if (pos == heap_size)
+        return;
+
+    // the last entry fills the hole and moves whichever way it has to
+    PlaceInHeap(pos, heap[heap_size]);
+    SiftUp(pos);
+    SiftDown(GetEntry(heap[pos])->heap_pos);
+}
+
+int QueueIndex::GetFirstDue(time_t now) const
+{
+    if (!heap_size || GetEntry(heap[0])->next_run > now)
+        return -1;
+
+    return heap[0];
+}
+
+time_t QueueIndex::GetNextRun() const
+{
+    return heap_size ? GetEntry(heap[0])->next_run: (time_t)-1;
+}
+
+
+
+int QueueIndex::GetCount() const { return count; }
+
+int QueueIndex::GetCapacity() const { return slab_count * K_SLAB_SIZE; }
+
+QueueEntry* QueueIndex::GetEntry(int handle) const
+{
+    return &slabs[handle / K_SLAB_SIZE][handle % K_SLAB_SIZE];
+}
+
+
+
+void QueueIndex::AddSlab()
+{
+    if (slab_count == max_slab_count) {
+        // only the slab pointers are copied, entries stay where they are
+        max_slab_count = max_slab_count ? 2 * max_slab_count: 16;
+        QueueEntry **new_slabs = new QueueEntry* [max_slab_count];
+        if (slabs) {
+            memcpy(new_slabs, slabs, slab_count * sizeof(QueueEntry*));
+            delete [] slabs;
+        }
+        slabs = new_slabs;
+    }
+
+    QueueEntry *slab = new QueueEntry [K_SLAB_SIZE];
+    int first = slab_count * K_SLAB_SIZE;
+
+    // lower handles are handed out first
+    for (int i = K_SLAB_SIZE - 1; i >= 0; i--) {
+        slab[i].message = 0;
+        slab[i].last_attempt = 0;
+        slab[i].next_run = 0;
+        slab[i].heap_pos = -1;
+        slab[i].deliveries = 0;
+        slab[i].hash_next = -1;
+        slab[i].next_free = free_head;
+        free_head = first + i;
+    }
+
+    slabs[slab_count++] = slab;
+}
+
+void QueueIndex::Rehash(int new_bucket_count)
+{
+    delete [] buckets;
+    bucket_count = new_bucket_count;
+    buckets = new int [bucket_count];
+    for (int i = 0; i < bucket_count; i++)
+        buckets[i] = -1;
+
+    for (int handle = 0; handle < GetCapacity(); handle++) {
+        QueueEntry *entry = GetEntry(handle);
+        if (!entry->message)
+            continue;
+
+        int bucket = GetBucket(entry->message->GetId());
+        entry->hash_next = buckets[bucket];
+        buckets[bucket] = handle;
+    }
+}
+
+int QueueIndex::GetBucket(const char *id) const
+{
+    // bucket_count is a power of two
+    return hash_string(id) & (bucket_count - 1);
+}
+
+
+
+void QueueIndex::SiftUp(int pos)
+{
+    int handle = heap[pos];
+    time_t when = GetEntry(handle)->next_run;
+
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (GetEntry(heap[parent])->next_run <= when)
+            break;
+        PlaceInHeap(pos, heap[parent]);
+        pos = parent;
+    }
+    PlaceInHeap(pos, handle);
+}
+
+void QueueIndex::SiftDown(int pos)
+{
+    int handle = heap[pos];
+    time_t when = GetEntry(handle)->next_run;
+
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= heap_size)
+            break;
+        if (child + 1 < heap_size &&
+            GetEntry(heap[child + 1])->next_run <
+            GetEntry(heap[child])->next_run)
+            child++;
+        if (when <= GetEntry(heap[child])->next_run)
+            break;
+        PlaceInHeap(pos, heap[child]);
+        pos = child;
+    }
+    PlaceInHeap(pos, handle);
+}
+
+void QueueIndex::PlaceInHeap(int pos, int handle)
+{
+    heap[pos] = handle;
+    GetEntry(handle)->heap_pos = pos;
+}
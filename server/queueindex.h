@@ -0,0 +1,85 @@
+#ifndef QUEUEINDEX_H_SENTRY
+#define QUEUEINDEX_H_SENTRY
+
+#include <time.h>
+
+class Message;
+
+struct QueueEntry
+{
+    //0 while the entry is on the free list
+    Message *message;
+
+    time_t last_attempt;
+    //When the entry is due next, an attempt or its expiry
+    time_t next_run;
+
+    //Position in the schedule heap, -1 when it is not scheduled
+    int heap_pos;
+    //Outbound transactions still running for the message
+    int deliveries;
+    //Free list link while unused
+    int next_free;
+    //Id hash chain while used
+    int hash_next;
+};
+
+// Queue entries live in fixed size slabs that are never moved, so the
+// index grows without copying and an entry pointer stays valid until
+// the entry is removed. Handles are plain entry numbers.
+// Scheduled entries are also kept in a binary min-heap on next_run,
+// so the queue run only looks at the entries that are due.
+class QueueIndex
+{
+    enum {
+        K_SLAB_SIZE = 1024
+    };
+
+    QueueEntry **slabs;
+    int slab_count, max_slab_count;
+
+    int free_head;
+    int count;
+
+    int *buckets;
+    int bucket_count;
+
+    int *heap;
+    int heap_size, max_heap_size;
+
+public:
+    QueueIndex();
+    ~QueueIndex();
+
+    //Returns the handle of the new entry
+    int Insert(Message *message, time_t last_attempt);
+    //The caller deletes the message
+    void Remove(int handle);
+    //Handle of the message with this id, -1 if there is none
+    int Find(const char *id) const;
+
+    //Sets when the entry is due, scheduling it if it was not
+    void Schedule(int handle, time_t when);
+    //Takes the entry out of the schedule until it is scheduled again
+    void Unschedule(int handle);
+    //The entry that is due first if it is due by now, -1 otherwise
+    int GetFirstDue(time_t now) const;
+    //When the first entry is due, -1 if nothing is scheduled
+    time_t GetNextRun() const;
+
+    int GetCount() const;
+    //Handles are below this, unused ones have no message
+    int GetCapacity() const;
+    QueueEntry* GetEntry(int handle) const;
+
+private:
+    void AddSlab();
+    void Rehash(int new_bucket_count);
+    int GetBucket(const char *id) const;
+
+    void SiftUp(int pos);
+    void SiftDown(int pos);
+    void PlaceInHeap(int pos, int handle);
+};
+
+#endif
@@ -0,0 +1,379 @@
+#include "queuejournal.h"
+#include "hash.h"
+#include "daemon.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+QueueJournalRecord::QueueJournalRecord()
+{
+    type = 0;
+    id = spool_path = 0;
+    time = 0;
+}
+
+QueueJournalRecord::~QueueJournalRecord()
+{
+    Clear();
+}
+
+void QueueJournalRecord::Clear()
+{
+    if (id)
+        free((void*)id);
+    if (spool_path)
+        free((void*)spool_path);
+
+    type = 0;
+    id = spool_path = 0;
+    time = 0;
+}
+
+
+
+
+
+QueueJournal::QueueJournal()
+{
+    path = 0;
+    fd = -1;
+
+    replay_file = 0;
+    replay_offset = 0;
+    replay_line = 0;
+    replay_line_size = 0;
+
+    record_count = 0;
+    unsynced_count = 0;
+
+    fsync_batch = 32;
+    fsync_interval = 100;
+    compact_records = 10000;
+}
+
+QueueJournal::~QueueJournal()
+{
+    Close();
+}
+
+void QueueJournal::SetSyncPolicy(int a_fsync_batch, int a_fsync_interval)
+{
+    fsync_batch = a_fsync_batch;
+    fsync_interval = a_fsync_interval;
+}
+
+void QueueJournal::SetCompactThreshold(int a_compact_records)
+{
+    compact_records = a_compact_records;
+}
+
+
+
+int QueueJournal::Open(const char *a_path)
+{
+    Close();
+
+    path = strdup(a_path);
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't open %s queue journal\n(%s)\n",
+            path,
+            strerror(errno)
+        );
+        return -1;
+    }
+
+    return 0;
+}
+
+void QueueJournal::Close()
+{
+    EndReplay();
+
+    if (fd >= 0) {
+        Sync();
+        close(fd);
+    }
+    fd = -1;
+
+    if (path)
+        free((void*)path);
+    path = 0;
+}
+
+
+
+int QueueJournal::AppendAdd(
+    const char *id,
+    const char *spool_path,
+    time_t create_time
+)
+{
+    int len = strlen(id) + strlen(spool_path) + 64;
+    char *line = new char [len];
+    len = snprintf(
+        line, len,
+        "%c\t%ld\t%s\t%s",
+        rec_add, (long int)create_time, id, spool_path
+    );
+
+    int status = Append(line, len);
+    delete [] line;
+
+    return status;
+}
+
+int QueueJournal::AppendAttempt(const char *id, time_t attempt_time)
+{
+    int len = strlen(id) + 64;
+    char *line = new char [len];
+    len = snprintf(
+        line, len,
+        "%c\t%ld\t%s",
+        rec_attempt, (long int)attempt_time, id
+    );
+
+    int status = Append(line, len);
+    delete [] line;
+
+    return status;
+}
+
+int QueueJournal::AppendRemove(const char *id)
+{
+    int len = strlen(id) + 64;
+    char *line = new char [len];
+    len = snprintf(line, len, "%c\t0\t%s", rec_remove, id);
+
+    int status = Append(line, len);
+    delete [] line;
+
+    return status;
+}
+
+
+
+int QueueJournal::Sync()
+{
+    if (fd < 0 || !unsynced_count)
+        return 0;
+
+    unsynced_count = 0;
+    if (fdatasync(fd) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Queue journal fsync failed\n(%s)\n",
+            strerror(errno)
+        );
+        return -1;
+    }
+
+    return 0;
+}
+
+void QueueJournal::SyncIfDue()
+{
+    if (GetSyncTimeout() == 0)
+        Sync();
+}
+
+long QueueJournal::GetSyncTimeout() const
+{
+    if (fd < 0 || !unsynced_count)
+        return -1;
+
+    if (unsynced_count >= fsync_batch)
+        return 0;
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    long elapsed =
+        (now.tv_sec - first_unsynced.tv_sec) * 1000 +
+        (now.tv_usec - first_unsynced.tv_usec) / 1000;
+
+    return elapsed >= fsync_interval ? 0: fsync_interval - elapsed;
+}
+
+bool QueueJournal::ShouldCompact() const
+{
+    return fd >= 0 && record_count >= compact_records;
+}
+
+int QueueJournal::Reset()
+{
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, 0) < 0 || fsync(fd) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Queue journal truncate failed\n(%s)\n",
+            strerror(errno)
+        );
+        return -1;
+    }
+
+    record_count = 0;
+    unsynced_count = 0;
+
+    return 0;
+}
+
+
+
+int QueueJournal::BeginReplay()
+{
+    EndReplay();
+
+    if (!path)
+        return -1;
+
+    replay_file = fopen(path, "r");
+    replay_offset = 0;
+    record_count = 0;
+
+    return replay_file ? 0: -1;
+}
+
+int QueueJournal::ReadRecord(QueueJournalRecord *rec)
+{
+    rec->Clear();
+
+    if (!replay_file)
+        return 0;
+
+    ssize_t read_len = getline(&replay_line, &replay_line_size, replay_file);
+
+    if (read_len <= 0 || replay_line[read_len - 1] != '\n') {
+        if (read_len > 0) {
+            write_log(
+                "[SMTP-DAEMON] Queue journal %s has a torn tail at %ld\n",
+                path,
+                replay_offset
+            );
+            if (fd >= 0)
+                ftruncate(fd, replay_offset);
+        }
+        return 0;
+    }
+
+    int len = read_len - 1;
+    char *buf = replay_line;
+    buf[len] = '\0';
+
+    char *crc = strrchr(buf, '\t');
+    bool valid = (crc != 0) &&
+        (strtoul(crc + 1, 0, 16) == Checksum(buf, crc - buf));
+
+    if (valid) {
+        *crc = '\0';
+
+        char *p = buf;
+        char *type = NextField(p);
+        char *time_val = NextField(p);
+
+        rec->type = type ? type[0] : 0;
+        rec->time = time_val ? strtol(time_val, 0, 10) : 0;
+
+        char *id = NextField(p);
+        rec->id = id ? strdup(id) : 0;
+
+        if (rec->type == rec_add) {
+            char *spool_path = NextField(p);
+            rec->spool_path = spool_path ? strdup(spool_path) : 0;
+            valid = rec->spool_path != 0;
+        } else {
+            valid = (rec->type == rec_attempt) || (rec->type == rec_remove);
+        }
+        valid = valid && rec->id;
+    }
+
+    if (!valid) {
+        write_log(
+            "[SMTP-DAEMON] Queue journal %s is corrupted at %ld, "
+            "dropping the rest\n",
+            path,
+            replay_offset
+        );
+        rec->Clear();
+        if (fd >= 0)
+            ftruncate(fd, replay_offset);
+        EndReplay();
+        return 0;
+    }
+
+    replay_offset += len + 1;
+    record_count++;
+
+    return 1;
+}
+
+void QueueJournal::EndReplay()
+{
+    if (replay_file)
+        fclose(replay_file);
+    replay_file = 0;
+
+    if (replay_line)
+        free((void*)replay_line);
+    replay_line = 0;
+    replay_line_size = 0;
+}
+
+
+
+int QueueJournal::Append(char *line, int len)
+{
+    if (fd < 0)
+        return -1;
+
+    // checksum, separator and newline are appended to the caller's buffer
+    len += sprintf(line + len, "\t%08x\n", Checksum(line, len));
+
+    if (write(fd, line, len) != len) {
+        write_log(
+            "[SMTP-DAEMON] Queue journal write failed\n(%s)\n",
+            strerror(errno)
+        );
+        return -1;
+    }
+
+    if (!unsynced_count)
+        gettimeofday(&first_unsynced, 0);
+    unsynced_count++;
+    record_count++;
+
+    if (unsynced_count >= fsync_batch)
+        Sync();
+
+    return 0;
+}
+
+unsigned int QueueJournal::Checksum(const char *data, int len)
+{
+    // only has to catch torn and garbled records
+    return hash_data(k_hash_basis, data, len);
+}
+
+char* QueueJournal::NextField(char *&p)
+{
+    if (!p)
+        return 0;
+
+    char *field = p;
+    char *tab = strchr(p, '\t');
+    if (tab) {
+        *tab = '\0';
+        p = tab + 1;
+    } else {
+        p = 0;
+    }
+
+    return field;
+}
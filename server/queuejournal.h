@@ -0,0 +1,83 @@
+#ifndef QUEUEJOURNAL_H_SENTRY
+#define QUEUEJOURNAL_H_SENTRY
+
+#include <time.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+struct QueueJournalRecord
+{
+    char type;
+    char *id;
+    char *spool_path;
+    time_t time;
+
+    QueueJournalRecord();
+    ~QueueJournalRecord();
+
+    void Clear();
+};
+
+class QueueJournal
+{
+    char *path;
+    int fd;
+
+    FILE *replay_file;
+    long replay_offset;
+    //Reused by getline for every record of a replay
+    char *replay_line;
+    size_t replay_line_size;
+
+    //Records written since the last checkpoint
+    int record_count;
+    //Records written since the last fsync
+    int unsynced_count;
+    struct timeval first_unsynced;
+
+    int fsync_batch;
+    int fsync_interval;
+    int compact_records;
+
+public:
+    enum {
+        rec_add     = 'A',
+        rec_attempt = 'T',
+        rec_remove  = 'R'
+    };
+
+    QueueJournal();
+    ~QueueJournal();
+
+    void SetSyncPolicy(int a_fsync_batch, int a_fsync_interval);
+    void SetCompactThreshold(int a_compact_records);
+
+    int Open(const char *a_path);
+    void Close();
+
+    int AppendAdd(const char *id, const char *spool_path, time_t create_time);
+    int AppendAttempt(const char *id, time_t attempt_time);
+    int AppendRemove(const char *id);
+
+    int Sync();
+    void SyncIfDue();
+    //Milliseconds until the pending records must be synced, -1 if none
+    long GetSyncTimeout() const;
+
+    bool ShouldCompact() const;
+    //Drop all records, the caller has just written a checkpoint
+    int Reset();
+
+    //Replay stops at the first torn or corrupted record and cuts
+    //the journal there, so new records never follow garbage
+    int BeginReplay();
+    int ReadRecord(QueueJournalRecord *rec);
+    void EndReplay();
+
+private:
+    int Append(char *line, int len);
+    static unsigned int Checksum(const char *data, int len);
+    static char* NextField(char *&p);
+};
+
+#endif
@@ -0,0 +1,322 @@
+#include "queuerecovery.h"
+#include "mailqueue.h"
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+enum {
+    K_BUCKET_COUNT = 256 * 256
+};
+
+struct RecoveryWorker
+{
+    pthread_t thread;
+    QueueRecovery *owner;
+
+    RecoveredMessage *messages;
+    int message_count, max_message_count;
+
+    int checked_count;
+    int quarantined_count;
+    int finished_count;
+    int removed_count;
+};
+
+static bool has_suffix(const char *name, int len, const char *suffix)
+{
+    int suffix_len = strlen(suffix);
+    return len >= suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+QueueRecovery::QueueRecovery(const char *a_queue_dir, int a_thread_count)
+{
+    int len = strlen(a_queue_dir);
+    queue_dir = new char [len + 2];
+    strcpy(queue_dir, a_queue_dir);
+    if (len && queue_dir[len - 1] != '/')
+        strcat(queue_dir, "/");
+
+    quarantine_dir = new char [strlen(queue_dir) + 12];
+    sprintf(quarantine_dir, "%squarantine/", queue_dir);
+
+    thread_count = a_thread_count > 0 ? a_thread_count: 1;
+
+    pthread_mutex_init(&mutex, 0);
+    next_bucket = 0;
+
+    messages = 0;
+    message_count = 0;
+
+    checked_count = quarantined_count = finished_count = removed_count = 0;
+}
+
+QueueRecovery::~QueueRecovery()
+{
+    for (int i = 0; i < message_count; i++) {
+        free((void*)messages[i].id);
+        delete [] messages[i].spool_path;
+    }
+    if (messages)
+        delete [] messages;
+
+    delete [] queue_dir;
+    delete [] quarantine_dir;
+
+    pthread_mutex_destroy(&mutex);
+}
+
+int QueueRecovery::Run()
+{
+    mkdir(quarantine_dir, S_IRWXU);
+
+    RecoveryWorker *workers = new RecoveryWorker [thread_count];
+    memset(workers, 0, thread_count * sizeof(RecoveryWorker));
+
+    int started = 0;
+    for (int i = 0; i < thread_count; i++) {
+        workers[i].owner = this;
+        if (pthread_create(&workers[i].thread, 0, ThreadFunc, &workers[i])) {
+            write_log("[SMTP-DAEMON] Can't start spool recovery thread\n");
+            break;
+        }
+        started++;
+    }
+
+    // nothing runs in parallel, but the walk still has to happen
+    if (!started) {
+        Walk(&workers[0]);
+        started = 1;
+    } else {
+        for (int i = 0; i < started; i++)
+            pthread_join(workers[i].thread, 0);
+    }
+
+    int total = 0;
+    for (int i = 0; i < started; i++)
+        total += workers[i].message_count;
+
+    messages = new RecoveredMessage [total > 0 ? total: 1];
+    for (int i = 0; i < started; i++) {
+        memcpy(
+            messages + message_count,
+            workers[i].messages,
+            workers[i].message_count * sizeof(RecoveredMessage)
+        );
+        message_count += workers[i].message_count;
+        if (workers[i].messages)
+            delete [] workers[i].messages;
+
+        checked_count += workers[i].checked_count;
+        quarantined_count += workers[i].quarantined_count;
+        finished_count += workers[i].finished_count;
+        removed_count += workers[i].removed_count;
+    }
+    delete [] workers;
+
+    qsort(messages, message_count, sizeof(RecoveredMessage), CompareMessages);
+
+    return 0;
+}
+
+
+
+int QueueRecovery::GetMessageCount() const { return message_count; }
+
+const RecoveredMessage* QueueRecovery::GetMessage(int idx) const
+{
+    return &messages[idx];
+}
+
+int QueueRecovery::FindMessage(const char *id) const
+{
+    int lo = 0, hi = message_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(messages[mid].id, id);
+        if (!cmp)
+            return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+int QueueRecovery::GetCheckedCount() const { return checked_count; }
+
+int QueueRecovery::GetQuarantinedCount() const { return quarantined_count; }
+
+int QueueRecovery::GetFinishedCount() const { return finished_count; }
+
+int QueueRecovery::GetRemovedCount() const { return removed_count; }
+
+
+
+void* QueueRecovery::ThreadFunc(void *arg)
+{
+    RecoveryWorker *worker = (RecoveryWorker*)arg;
+    worker->owner->Walk(worker);
+    return 0;
+}
+
+void QueueRecovery::Walk(RecoveryWorker *worker)
+{
+    char *bucket_path = new char [strlen(queue_dir) + 8];
+
+    // buckets are handed out one by one, so a few crowded ones
+    // do not hold up a single thread
+    for (;;) {
+        pthread_mutex_lock(&mutex);
+        int bucket = next_bucket++;
+        pthread_mutex_unlock(&mutex);
+
+        if (bucket >= K_BUCKET_COUNT)
+            break;
+
+        sprintf(
+            bucket_path, "%s%02x/%02x",
+            queue_dir, bucket >> 8, bucket & 0xff
+        );
+        ScanBucket(worker, bucket_path);
+    }
+
+    delete [] bucket_path;
+}
+
+void QueueRecovery::ScanBucket(RecoveryWorker *worker, const char *bucket_path)
+{
+    DIR *dir = opendir(bucket_path);
+    if (!dir)
+        return;
+
+    int bucket_len = strlen(bucket_path);
+    char *path = new char [bucket_len + 1 + 256 + 1];
+    memcpy(path, bucket_path, bucket_len);
+    path[bucket_len] = '/';
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != 0) {
+        const char *name = entry->d_name;
+        int name_len = strlen(name);
+        if (name[0] == '.')
+            continue;
+
+        memcpy(path + bucket_len + 1, name, name_len + 1);
+
+        if (has_suffix(name, name_len, ".spl")) {
+            CheckRecord(worker, path);
+        } else if (has_suffix(name, name_len, ".spl.tmp")) {
+            // the commit never finished, so it was never acknowledged
+            if (!remove(path))
+                worker->removed_count++;
+        } else if (has_suffix(name, name_len, ".mime")) {
+            char *spool_path = new char [bucket_len + 1 + name_len + 1];
+            sprintf(spool_path, "%.*s.spl", bucket_len + 1 + name_len - 5, path);
+
+            struct stat st;
+            if (stat(spool_path, &st) < 0 && errno == ENOENT && !remove(path))
+                worker->removed_count++;
+            delete [] spool_path;
+        }
+    }
+
+    closedir(dir);
+    delete [] path;
+}
+
+void QueueRecovery::CheckRecord(RecoveryWorker *worker, const char *path)
+{
+    worker->checked_count++;
+
+    SpoolRecordInfo info;
+    int status = Message::VerifySpoolFile(path, &info);
+
+    if (status < 0) {
+        Quarantine(path);
+        worker->quarantined_count++;
+        return;
+    }
+
+    if (info.pending_count == 0) {
+        // every recipient is done, only the removal was lost
+        Message message(info.id, path, info.create_time);
+        message.DeleteMessage();
+        free((void*)info.id);
+        worker->finished_count++;
+        return;
+    }
+
+    if (worker->message_count >= worker->max_message_count) {
+        int new_max = worker->max_message_count ?
+            2 * worker->max_message_count: 1024;
+        RecoveredMessage *new_messages = new RecoveredMessage [new_max];
+        if (worker->messages) {
+            memcpy(
+                new_messages,
+                worker->messages,
+                worker->message_count * sizeof(RecoveredMessage)
+            );
+            delete [] worker->messages;
+        }
+        worker->messages = new_messages;
+        worker->max_message_count = new_max;
+    }
+
+    RecoveredMessage *rec = &worker->messages[worker->message_count++];
+    rec->id = info.id;
+    rec->spool_path = new char [strlen(path) + 1];
+    strcpy(rec->spool_path, path);
+    rec->create_time = info.create_time;
+    rec->last_attempt = info.last_attempt;
+}
+
+void QueueRecovery::Quarantine(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1: path;
+
+    char *new_path = new char [strlen(quarantine_dir) + strlen(name) + 1];
+    sprintf(new_path, "%s%s", quarantine_dir, name);
+
+    write_log(
+        "[SMTP-DAEMON] Spool file %s is corrupted, moved to %s\n",
+        path,
+        new_path
+    );
+    if (rename(path, new_path) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't quarantine spool file %s\n(%s)\n",
+            path,
+            strerror(errno)
+        );
+    }
+
+    // the sidecar is of no use without its record
+    int len = strlen(path);
+    char *mime_path = new char [len + 2];
+    sprintf(mime_path, "%.*s.mime", len - 4, path);
+    remove(mime_path);
+
+    delete [] mime_path;
+    delete [] new_path;
+}
+
+
+
+int QueueRecovery::CompareMessages(const void *a, const void *b)
+{
+    return strcmp(
+        ((const RecoveredMessage*)a)->id,
+        ((const RecoveredMessage*)b)->id
+    );
+}
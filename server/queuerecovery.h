@@ -0,0 +1,66 @@
+#ifndef QUEUERECOVERY_H_SENTRY
+#define QUEUERECOVERY_H_SENTRY
+
+#include <time.h>
+#include <pthread.h>
+
+struct RecoveredMessage
+{
+    char *id;
+    char *spool_path;
+    time_t create_time;
+    time_t last_attempt;
+};
+
+struct RecoveryWorker;
+
+// Walks the <queue_dir>/XX/YY buckets with a pool of threads and
+// checks every spool record it finds. Valid records with recipients
+// left to send are collected, corrupted ones are moved to
+// <queue_dir>/quarantine, finished ones and leftovers of unfinished
+// commits are removed. The queue itself is not touched here.
+class QueueRecovery
+{
+    char *queue_dir;
+    char *quarantine_dir;
+    int thread_count;
+
+    pthread_mutex_t mutex;
+    int next_bucket;
+
+    //Sorted by id after Run
+    RecoveredMessage *messages;
+    int message_count;
+
+    int checked_count;
+    int quarantined_count;
+    int finished_count;
+    int removed_count;
+
+public:
+    QueueRecovery(const char *a_queue_dir, int a_thread_count);
+    ~QueueRecovery();
+
+    int Run();
+
+    int GetMessageCount() const;
+    const RecoveredMessage* GetMessage(int idx) const;
+    //Binary search by id, -1 if the record was not found
+    int FindMessage(const char *id) const;
+
+    int GetCheckedCount() const;
+    int GetQuarantinedCount() const;
+    int GetFinishedCount() const;
+    int GetRemovedCount() const;
+
+private:
+    static void* ThreadFunc(void *arg);
+    void Walk(RecoveryWorker *worker);
+    void ScanBucket(RecoveryWorker *worker, const char *bucket_path);
+    void CheckRecord(RecoveryWorker *worker, const char *path);
+    void Quarantine(const char *path);
+
+    static int CompareMessages(const void *a, const void *b);
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "relayhosts.h"
+#include "deliverylimits.h"
+#include "connectioncache.h"
+#include "destinationhealth.h"
+#include "daemon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netdb.h>
+#include <arpa/inet.h>
+
+const char *RelayHosts::K_DESTINATION = "[relay]";
+
+RelayHosts::RelayHosts()
+{
+    hosts = 0;
+    host_count = 0;
+    max_host_connections = 0;
+    turn = 0;
+}
+
+RelayHosts::~RelayHosts()
+{
+    for (int i = 0; i < host_count; i++) {
+        free((void*)hosts[i].name);
+        free((void*)hosts[i].key);
+    }
+    if (hosts)
+        delete [] hosts;
+}
+
+int RelayHosts::Load(const char *list)
+{
+    // one slot per separator is more than enough
+    int max_count = 1;
+    for (const char *p = list; *p; p++) {
+        if (*p == ',' || *p == ' ' || *p == '\t')
+            max_count++;
+    }
+    hosts = new RelayHost [max_count];
+
+    char *copy = strdup(list);
+    int status = 0;
+    for (char *spec = strtok(copy, ", \t"); spec; spec = strtok(0, ", \t")) {
+        if (AddHost(spec) < 0) {
+            status = -1;
+            break;
+        }
+    }
+    free((void*)copy);
+
+    return status;
+}
+
+void RelayHosts::SetMaxHostConnections(int a_max_host_connections)
+{
+    max_host_connections = a_max_host_connections;
+}
+
+bool RelayHosts::IsEnabled() const { return host_count > 0; }
+
+int RelayHosts::GetCount() const { return host_count; }
+
+const RelayHost* RelayHosts::GetHost(int idx) const { return &hosts[idx]; }
+
+int RelayHosts::GetMaxHostConnections() const { return max_host_connections; }
+
+int RelayHosts::GetMaxConnections() const
+{
+    return max_host_connections * host_count;
+}
+
+void RelayHosts::GetOrder(
+    int *order,
+    const DeliveryLimits *limits,
+    const ConnectionCache *cache,
+    const DestinationHealth *health,
+    time_t now
+)
+{
+    int *ranks = new int [host_count];
+
+    // insertion sort from the host whose turn it is, alike hosts keep
+    // that order, so new connections are spread over all of them
+    for (int i = 0; i < host_count; i++) {
+        int idx = (turn + i) % host_count;
+        int rank = GetRank(idx, limits, cache, health, now);
+
+        int pos = i;
+        while (pos > 0 && ranks[pos - 1] > rank) {
+            ranks[pos] = ranks[pos - 1];
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        ranks[pos] = rank;
+        order[pos] = idx;
+    }
+    turn = (turn + 1) % host_count;
+
+    delete [] ranks;
+}
+
+char* RelayHosts::MakeKey(in_addr address, int port)
+{
+    char key[32];
+    if (port == 25)
+        strcpy(key, inet_ntoa(address));
+    else
+        sprintf(key, "%s:%d", inet_ntoa(address), port);
+
+    return strdup(key);
+}
+
+
+
+int RelayHosts::AddHost(const char *spec)
+{
+    char *name = strdup(spec);
+    int port = 25;
+
+    char *colon = strrchr(name, ':');
+    if (colon) {
+        *colon = 0;
+        port = atoi(colon + 1);
+    }
+
+    in_addr address;
+    if (!inet_aton(name, &address)) {
+        // resolved once here, a relay list names few hosts
+        hostent *host = gethostbyname(name);
+        if (!host || host->h_addrtype != AF_INET || !host->h_addr_list[0]) {
+            write_log("[SMTP-DAEMON] Relay host %s does not resolve\n", spec);
+            free((void*)name);
+            return -1;
+        }
+        memcpy(&address, host->h_addr_list[0], sizeof(address));
+    }
+    free((void*)name);
+
+    if (port <= 0 || port > 65535) {
+        write_log("[SMTP-DAEMON] Relay host %s has a bad port\n", spec);
+        return -1;
+    }
+
+    RelayHost *host = &hosts[host_count++];
+    host->name = strdup(spec);
+    host->address = address;
+    host->port = port;
+    host->key = MakeKey(address, port);
+
+    write_log(
+        "[SMTP-DAEMON] Relaying through %s (%s)\n",
+        host->name,
+        host->key
+    );
+
+    return 0;
+}
+
+int RelayHosts::GetRank(
+    int idx,
+    const DeliveryLimits *limits,
+    const ConnectionCache *cache,
+    const DestinationHealth *health,
+    time_t now
+) const
+{
+    const char *key = hosts[idx].key;
+
+    int rank = limits->GetAddressCount(key);
+    if (!cache->HasIdle(key))
+        rank += 1 << 16;
+    if (health->IsOpen(key, now))
+        rank += 1 << 17;
+
+    return rank;
+}
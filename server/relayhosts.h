@@ -0,0 +1,79 @@
+#ifndef RELAYHOSTS_H_SENTRY
+#define RELAYHOSTS_H_SENTRY
+
+#include <time.h>
+#include <netinet/in.h>
+
+class DeliveryLimits;
+class ConnectionCache;
+class DestinationHealth;
+
+struct RelayHost
+{
+    //As configured, for the log
+    char *name;
+    in_addr address;
+    int port;
+    //Dotted address, with the port unless it is 25, the key the
+    //limits, the connection cache and the health go by
+    char *key;
+};
+
+// Smarthosts every outbound message is relayed through instead of the
+// exchanges of its recipients' domains. The names are resolved once
+// when the list is loaded, so relaying needs no lookups. Every new
+// transaction goes through the hosts in the order GetOrder gives: the
+// ones that are failing last, then those with a connection idle in the
+// cache, then the least busy, turn about when they are alike.
+class RelayHosts
+{
+    RelayHost *hosts;
+    int host_count;
+    int max_host_connections;
+    //Where the next tie is broken
+    int turn;
+
+public:
+    //The destination relayed transactions are counted and queued under
+    static const char *K_DESTINATION;
+
+    RelayHosts();
+    ~RelayHosts();
+
+    //"host[:port]" separated by commas or blanks, -1 if a host does
+    //not resolve, the ones before it are kept
+    int Load(const char *list);
+    //Connections to one host at once, 0 for no limit
+    void SetMaxHostConnections(int a_max_host_connections);
+
+    bool IsEnabled() const;
+    int GetCount() const;
+    const RelayHost* GetHost(int idx) const;
+    int GetMaxHostConnections() const;
+    //Connections to all of them at once, 0 for no limit
+    int GetMaxConnections() const;
+
+    //Fills order with every host index, best first
+    void GetOrder(
+        int *order,
+        const DeliveryLimits *limits,
+        const ConnectionCache *cache,
+        const DestinationHealth *health,
+        time_t now
+    );
+
+    //Key of an address and a port, the caller frees it
+    static char* MakeKey(in_addr address, int port);
+
+private:
+    int AddHost(const char *spec);
+    int GetRank(
+        int idx,
+        const DeliveryLimits *limits,
+        const ConnectionCache *cache,
+        const DestinationHealth *health,
+        time_t now
+    ) const;
+};
+
+#endif
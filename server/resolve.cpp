@@ -3,11 +3,14 @@
 #include "daemon.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h> 
+#include <strings.h>
 #include <sys/socket.h> 
 #include <arpa/inet.h> 
 #include <netinet/in.h>
 #include <unistd.h> 
+#include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
 
@@ -15,73 +18,214 @@
 DNSMXResolver::DNSMXResolver() 
 {
     dns_server_count = 0;
+
+    random_fd = -1;
+    pending_head = 0;
 }
 
-DNSMXResolver::~DNSMXResolver() { }
+DNSMXResolver::~DNSMXResolver() 
+{
+    while (pending_head)
+        ReleaseQuery(pending_head);
+
+    if (random_fd >= 0)
+        close(random_fd);
+}
 
 
 
 
 int DNSMXResolver::Init() 
 {
-    return GetDNSServers();
+    if (GetDNSServers() < 0)
+        return -1;
+
+    if (!dns_server_count) {
+        write_log("[SMTP-DAEMON] DNSMXResolver found no name servers\n");
+        return -1;
+    }
+
+    random_fd = open("/dev/urandom", O_RDONLY);
+    if (random_fd < 0) {
+        write_log(
+            "[SMTP-DAEMON] DNSMXResolver could not open /dev/urandom: (%s)\n", 
+            strerror(errno)
+        );
+        return -1;
+    }
+
+    return 0;
 }
 
-char* DNSMXResolver::GetMXWithLowestPreference(const char *host)
+DNSQuery* DNSMXResolver::StartQuery(const char *host, int type)
 {
-    int s = socket(AF_INET , SOCK_DGRAM , IPPROTO_UDP);
-    if (s < 0) {
+    DNSQuery *query = new DNSQuery;
+    query->id = MakeId();
+    query->type = type;
+    query->host = strdup(host);
+    query->server.s_addr = 0;
+    query->deadline = 0;
+    query->tries = 0;
+    query->done = false;
+    query->status = -1;
+    query->mx_hosts = 0;
+    query->mx_count = 0;
+    query->addresses = 0;
+    query->address_count = 0;
+
+    query->next = pending_head;
+    pending_head = query;
+
+    // an unbound socket gets a random ephemeral port on the first send
+    query->sock_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (query->sock_fd < 0) {
         write_log(
-            "[SMTP-DAEMON] DNSMXResolver could not open socket: (%s)", 
+            "[SMTP-DAEMON] DNSMXResolver could not open socket: (%s)\n", 
             strerror(errno)
         );
-        return 0;
+        FinishQuery(query, -1);
+        return query;
+    }
+    fcntl(query->sock_fd, F_SETFL, fcntl(query->sock_fd, F_GETFL) | O_NONBLOCK);
+
+    if (SendQuery(query) < 0)
+        FinishQuery(query, -1);
+
+    return query;
+}
+
+void DNSMXResolver::ReleaseQuery(DNSQuery *query)
+{
+    if (!query->done) {
+        DNSQuery **link = &pending_head;
+        while (*link != query)
+            link = &(*link)->next;
+        *link = query->next;
+    }
+    if (query->sock_fd >= 0)
+        close(query->sock_fd);
+
+    free((void*)query->host);
+    for (int i = 0; i < query->mx_count; i++)
+        free((void*)query->mx_hosts[i]);
+    if (query->mx_hosts)
+        delete [] query->mx_hosts;
+    if (query->addresses)
+        delete [] query->addresses;
+    delete query;
+}
+
+void DNSMXResolver::GetFds(fd_set &read_fds, int &max_fd) const
+{
+    for (DNSQuery *query = pending_head; query; query = query->next) {
+        FD_SET(query->sock_fd, &read_fds);
+        if (query->sock_fd > max_fd)
+            max_fd = query->sock_fd;
+    }
+}
+
+void DNSMXResolver::HandleReplies(const fd_set &read_fds)
+{
+    DNSQuery *query = pending_head;
+    while (query) {
+        // an answered query leaves the list
+        DNSQuery *next = query->next;
+        if (FD_ISSET(query->sock_fd, &read_fds))
+            ReadReplies(query);
+        query = next;
+    }
+}
+
+void DNSMXResolver::CheckTimeouts(time_t now)
+{
+    DNSQuery *query = pending_head;
+    while (query) {
+        DNSQuery *next = query->next;
+
+        if (query->deadline <= now) {
+            // every try goes to the next name server
+            if (query->tries >= K_MAX_TRIES || SendQuery(query) < 0) {
+                write_log(
+                    "[SMTP-DAEMON] DNSMXResolver query for %s timed out\n",
+                    query->host
+                );
+                FinishQuery(query, -1);
+            }
+        }
+
+        query = next;
+    }
+}
+
+time_t DNSMXResolver::GetNextDeadline() const
+{
+    time_t deadline = -1;
+    for (DNSQuery *query = pending_head; query; query = query->next) {
+        if (deadline == -1 || query->deadline < deadline)
+            deadline = query->deadline;
+    }
+
+    return deadline;
+}
+
+
+
+int DNSMXResolver::SendQuery(DNSQuery *query)
+{
+    unsigned char buf[12 + K_MAX_NAME_SIZE + 2 + 4];
+    memset(buf, 0, 12);
+
+    buf[0] = query->id >> 8;
+    buf[1] = query->id & 0xff;
+    buf[2] = 0x01; // recursion desired
+    buf[5] = 1;    // one question
+
+    // the name goes out as length prefixed labels
+    int pos = 12;
+    const char *label = query->host;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        int label_len = dot ? dot - label: strlen(label);
+        if (label_len == 0 || label_len > 63 ||
+            pos + 1 + label_len >= 12 + K_MAX_NAME_SIZE) {
+            write_log(
+                "[SMTP-DAEMON] DNSMXResolver can't query bad name %s\n",
+                query->host
+            );
+            return -1;
+        }
+
+        buf[pos++] = label_len;
+        memcpy(buf + pos, label, label_len);
+        pos += label_len;
+
+        label += label_len;
+        if (*label == '.')
+            label++;
     }
- 
+    buf[pos++] = 0;
+
+    buf[pos++] = 0;
+    buf[pos++] = query->type;
+    buf[pos++] = 0;
+    buf[pos++] = 1; // class IN
+
     struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
     dest.sin_family = AF_INET;
-    dest.sin_port = htons(53);
-    dest.sin_addr.s_addr = inet_addr(dns_servers[0]);
+    dest.sin_port = htons(K_PORT);
+    dest.sin_addr.s_addr = inet_addr(
+        dns_servers[query->tries % dns_server_count]
+    );
+    query->server = dest.sin_addr;
 
-    unsigned char buf[K_BUF_SIZE];
-    struct DNS_HEADER *dns = NULL;
-    dns = (struct DNS_HEADER *)&buf;
- 
-    dns->id = (unsigned short) htons(getpid());
-    dns->qr = 0; //This is a query
-    dns->opcode = 0; //This is a standard query
-    dns->aa = 0; //Not Authoritative
-    dns->tc = 0; //This message is not truncated
-    dns->rd = 1; //Recursion Desired
-    dns->ra = 0; //Recursion not available!
-    dns->z = 0;
-    dns->ad = 0;
-    dns->cd = 0;
-    dns->rcode = 0;
-    dns->q_count = htons(1); //we have only 1 question
-    dns->ans_count = 0;
-    dns->auth_count = 0;
-    dns->add_count = 0;
-
-
-    unsigned char *_host = new unsigned char [strlen(host) + 1];
-    strcpy((char*)_host, host);
-
-    unsigned char *qname;
-    qname = (unsigned char*)&buf[sizeof(struct DNS_HEADER)];
-    ChangetoDNSNameFormat(qname, _host);
-    delete [] _host;
-
-    struct QUESTION *qinfo = NULL;
-    qinfo = (struct QUESTION*)&buf[sizeof(struct DNS_HEADER) + (strlen((const char*)qname) + 1)]; //fill it
- 
-    qinfo->qtype = htons(T_MX); //type of the query , A , MX , CNAME , NS etc
-    qinfo->qclass = htons(1); //its internet
+    query->tries++;
+    query->deadline = time(0) + K_QUERY_TIMEOUT;
 
     if (sendto(
-            s, 
+            query->sock_fd, 
             (char*)buf, 
-            sizeof(struct DNS_HEADER) + (strlen((const char*)qname) + 1) + sizeof(struct QUESTION), 
+            pos, 
             0, 
             (struct sockaddr*)&dest, 
             sizeof(dest)
@@ -90,75 +234,177 @@ char* DNSMXResolver::GetMXWithLowestPreference(const char *host)
             "[SMTP-DAEMON] DNSMXResolver sendto error: (%s)\n", 
             strerror(errno)
         );
-        return 0;
+        // the timeout tries again
     }
 
-    int i = sizeof dest;
-    if (recvfrom(
-            s, 
+    return 0;
+}
+
+void DNSMXResolver::ReadReplies(DNSQuery *query)
+{
+    unsigned char buf[K_BUF_SIZE];
+
+    while (!query->done) {
+        sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(
+            query->sock_fd, 
             (char*)buf, 
             K_BUF_SIZE, 
             0, 
-            (struct sockaddr*)&dest, 
-            (socklen_t*)&i
-        ) < 0) {
-        write_log(
-            "[SMTP-DAEMON] DNSMXResolver recvfrom error: (%s)\n", 
-            strerror(errno)
+            (sockaddr*)&from, 
+            &from_len
         );
-        return 0;
-    }
-
-    dns = (struct DNS_HEADER*) buf;
-
-    unsigned char *reader;
-    reader = &buf[sizeof(struct DNS_HEADER) + (strlen((const char*)qname) + 1) + sizeof(struct QUESTION)]; 
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                write_log(
+                    "[SMTP-DAEMON] DNSMXResolver recvfrom error: (%s)\n", 
+                    strerror(errno)
+                );
+            }
+            break;
+        }
 
-    struct RES_RECORD answers[K_MAX_ANSWER_SIZE];
-    int stop = 0, preference[K_MAX_ANSWER_SIZE], min_preference_idx = -1;
-    for(i = 0; i < ntohs(dns->ans_count); i++)
-    {
-        answers[i].name = ReadName(reader, buf, stop);
-        reader = reader + stop;
- 
-        answers[i].resource = (struct R_DATA*)(reader);
-        reader = reader + sizeof(struct R_DATA);
+        // anything else that reaches the port is dropped, the query
+        // keeps waiting for the real answer
+        bool from_server = from_len >= sizeof(from) &&
+            from.sin_family == AF_INET &&
+            from.sin_addr.s_addr == query->server.s_addr &&
+            from.sin_port == htons(K_PORT);
+        if (!from_server || !ParseReply(query, buf, len)) {
+            write_log(
+                "[SMTP-DAEMON] DNSMXResolver dropped a stray reply for %s "
+                "from %s\n",
+                query->host,
+                inet_ntoa(from.sin_addr)
+            );
+        }
+    }
+}
 
-        preference[i] = (*reader) * 256 + *(reader + 1);
-        answers[i].rdata = (char*)ReadName(reader + 2, buf, stop);
+bool DNSMXResolver::ParseReply(
+    DNSQuery *query, 
+    const unsigned char *buf, 
+    int len
+)
+{
+    if (len < 12 || !(buf[2] & 0x80))
+        return false;
+
+    unsigned short id = (buf[0] << 8) | buf[1];
+    int question_count = (buf[4] << 8) | buf[5];
+    if (id != query->id || question_count != 1)
+        return false;
+
+    // the question has to be the one asked, names compare without case
+    char name[K_MAX_NAME_SIZE];
+    int pos = ExpandName(buf, len, 12, name);
+    if (pos < 0 || pos + 4 > len || strcasecmp(name, query->host))
+        return false;
+    int qtype = (buf[pos] << 8) | buf[pos + 1];
+    int qclass = (buf[pos + 2] << 8) | buf[pos + 3];
+    if (qtype != query->type || qclass != 1)
+        return false;
+    pos += 4;
+
+    int rcode = buf[3] & 0x0f;
+    if (rcode == 3) {
+        // no such domain
+        FinishQuery(query, 1);
+        return true;
+    }
+    if (rcode != 0) {
+        FinishQuery(query, -1);
+        return true;
+    }
 
-        reader = reader + ntohs(answers[i].resource->data_len);
+    int answer_count = (buf[6] << 8) | buf[7];
 
-        if (min_preference_idx == -1 || 
-            preference[i] ) {
-            min_preference_idx = i;
+    int *preferences = 0;
+    if (answer_count > 0) {
+        if (query->type == T_MX) {
+            query->mx_hosts = new char* [answer_count];
+            preferences = new int [answer_count];
+        } else {
+            query->addresses = new in_addr [answer_count];
         }
     }
 
-    return answers[min_preference_idx].rdata;
-}
+    for (int i = 0; i < answer_count && pos >= 0; i++) {
+        pos = SkipName(buf, len, pos);
+        if (pos < 0 || pos + 10 > len)
+            break;
+
+        int type = (buf[pos] << 8) | buf[pos + 1];
+        int data_len = (buf[pos + 8] << 8) | buf[pos + 9];
+        pos += 10;
+        if (pos + data_len > len)
+            break;
+
+        // CNAME records and the like are passed over
+        if (type == T_MX && query->type == T_MX && data_len > 2) {
+            int preference = (buf[pos] << 8) | buf[pos + 1];
+            if (ExpandName(buf, len, pos + 2, name) >= 0) {
+                // kept sorted as they come, equal ones in answer order
+                int j = query->mx_count++;
+                while (j > 0 && preferences[j - 1] > preference) {
+                    preferences[j] = preferences[j - 1];
+                    query->mx_hosts[j] = query->mx_hosts[j - 1];
+                    j--;
+                }
+                preferences[j] = preference;
+                query->mx_hosts[j] = strdup(name);
+            }
+        } else if (type == T_A && query->type == T_A && data_len == 4) {
+            memcpy(&query->addresses[query->address_count++], buf + pos, 4);
+        }
 
+        pos += data_len;
+    }
 
+    if (preferences)
+        delete [] preferences;
 
+    bool found = query->type == T_MX ?
+        query->mx_count > 0: query->address_count > 0;
+    FinishQuery(query, found ? 0: 1);
+    return true;
+}
 
-void DNSMXResolver::ChangetoDNSNameFormat(
-    unsigned char *dns, 
-    unsigned char *host)
+unsigned short DNSMXResolver::MakeId()
 {
-    int lock = 0 , i;
+    for (;;) {
+        unsigned short id;
+        if (read(random_fd, &id, sizeof(id)) != sizeof(id)) {
+            // /dev/urandom does not run dry, this is only a fallback
+            id = (unsigned short)rand();
+        }
 
-    strcat((char*)host, ".");
+        DNSQuery *query = pending_head;
+        while (query && query->id != id)
+            query = query->next;
+        if (!query)
+            return id;
+    }
+}
 
-    for(i = 0 ; i < (int)strlen((const char*)host); i++) {
-        if(host[i] == '.') {
-            *dns++ = i - lock;
-            for(; lock < i; lock++) {
-                *dns++=host[lock];
-            }
-            lock++;
-        }
+void DNSMXResolver::FinishQuery(DNSQuery *query, int status)
+{
+    DNSQuery **link = &pending_head;
+    while (*link != query)
+        link = &(*link)->next;
+    *link = query->next;
+
+    query->next = 0;
+    query->done = true;
+    query->status = status;
+
+    if (query->sock_fd >= 0) {
+        close(query->sock_fd);
+        query->sock_fd = -1;
     }
-    *dns++='\0';
 }
 
 int DNSMXResolver::GetDNSServers() 
@@ -213,51 +459,56 @@ int DNSMXResolver::GetDNSServers()
     return 0;
 }
 
-unsigned char* DNSMXResolver::ReadName(
-    unsigned char* reader,
-    unsigned char* buffer,
-    int &count)
+int DNSMXResolver::ExpandName(
+    const unsigned char *buf, int len,
+    int pos,
+    char *name
+)
 {
-    unsigned char *name;
-    
-    count = 1;
-    name = new unsigned char [256];
-    name[0] = '\0';
-
-    unsigned int p = 0, jumped = 0, offset;
-    while (*reader != 0) {
-        if (*reader >= 192) {
-            offset = (*reader) * 256 + *(reader + 1) - 49152; 
-            reader = buffer + offset - 1;
-            jumped = 1;
-        } else {
-            name[p++] = *reader;
+    int end = -1, name_len = 0, jumps = 0;
+
+    while (pos < len) {
+        int label_len = buf[pos];
+
+        if (label_len == 0) {
+            name[name_len] = '\0';
+            return end >= 0 ? end: pos + 1;
         }
 
-        reader = reader + 1;
+        if ((label_len & 0xc0) == 0xc0) {
+            // compression pointer, the name goes on elsewhere
+            if (pos + 1 >= len || ++jumps > 16)
+                return -1;
+            if (end < 0)
+                end = pos + 2;
+            pos = ((label_len & 0x3f) << 8) | buf[pos + 1];
+            continue;
+        }
 
-        if (jumped == 0) 
-            count = count + 1;
-    }
+        if (pos + 1 + label_len > len ||
+            name_len + label_len + 2 > K_MAX_NAME_SIZE)
+            return -1;
 
-    name[p] = '\0';
-    if (jumped == 1) {
-        count = count + 1;
+        if (name_len)
+            name[name_len++] = '.';
+        memcpy(name + name_len, buf + pos + 1, label_len);
+        name_len += label_len;
+        pos += 1 + label_len;
     }
 
-    int i, j;
-    for (i = 0; i < (int)strlen((const char*)name); i++) {
-        p = name[i];
-        for (j = 0; j < (int)p; j++) {
-            name[i] = name[i + 1];
-            i++;
-        }
-        name[i]='.';
-    }
-    
-    name[i - 1] = '\0';
-    
-    return name;
+    return -1;
+}
 
+int DNSMXResolver::SkipName(const unsigned char *buf, int len, int pos)
+{
+    while (pos < len) {
+        int label_len = buf[pos];
+        if (label_len == 0)
+            return pos + 1;
+        if ((label_len & 0xc0) == 0xc0)
+            return pos + 2 <= len ? pos + 2: -1;
+        pos += 1 + label_len;
+    }
 
-}
\ No newline at end of file
+    return -1;
+}
@@ -1,95 +1,111 @@
 #ifndef RESOLVE_H_SENTRY
 #define RESOLVE_H_SENTRY
 
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/select.h>
 
-class DNSMXResolver {
-    enum 
-    {
-        T_MX = 15 
-    };
+struct DNSQuery
+{
+    unsigned short id;
+    int type;
+    char *host;
 
-    struct DNS_HEADER
-    {
-        unsigned short id; // identification number
-     
-        unsigned char rd :1; // recursion desired
-        unsigned char tc :1; // truncated message
-        unsigned char aa :1; // authoritive answer
-        unsigned char opcode :4; // purpose of message
-        unsigned char qr :1; // query/response flag
-     
-        unsigned char rcode :4; // response code
-        unsigned char cd :1; // checking disabled
-        unsigned char ad :1; // authenticated data
-        unsigned char z :1; // its z! reserved
-        unsigned char ra :1; // recursion available
-     
-        unsigned short q_count; // number of question entries
-        unsigned short ans_count; // number of answer entries
-        unsigned short auth_count; // number of authority entries
-        unsigned short add_count; // number of resource entries
-    };
+    //Socket of its own, so every query leaves from a port the kernel
+    //picked at random, -1 once the query is done
+    int sock_fd;
+    //Name server the current try went to, only it may answer
+    in_addr server;
 
-    struct QUESTION
-    {
-        unsigned short qtype;
-        unsigned short qclass;
-    };
-     
-    #pragma pack(push, 1)
-    struct R_DATA
-    {
-        unsigned short type;
-        unsigned short _class;
-        unsigned int ttl;
-        unsigned short data_len;
-    };
-    #pragma pack(pop)
-     
-    struct RES_RECORD
-    {
-        unsigned char *name;
-        struct R_DATA *resource;
-        char *rdata;
-    };
+    //When the current try gives up
+    time_t deadline;
+    int tries;
 
-    typedef struct
-    {
-        unsigned char *name;
-        struct QUESTION *ques;
-    } QUERY;
+    //Set once the answer came or the query gave up
+    bool done;
+    //0 if found, 1 if the name has no such records, -1 on failure
+    int status;
 
-    enum 
+    //Exchanges by preference, lowest first (MX), addresses in the
+    //order the server gave them (A)
+    char **mx_hosts;
+    int mx_count;
+    in_addr *addresses;
+    int address_count;
+
+    //Pending list link
+    DNSQuery *next;
+};
+
+// Every query goes out over a non-blocking UDP socket of its own and
+// the main loop feeds the replies in, so a slow name server holds up
+// nobody but the deliveries waiting for that name. A reply is taken
+// only if it comes from the server asked, on the query's socket, with
+// its random id and its question, so a forged answer has to guess the
+// port and the id together.
+class DNSMXResolver {
+    enum
     {
         K_MAX_DNS_SERVER_COUNT = 10,
         K_MAX_DNS_SERVER_SIZE  = 100,
         K_BUF_SIZE = 65536,
-        K_MAX_ANSWER_SIZE = 20, 
-        K_PORT = 53
+        K_MAX_NAME_SIZE = 256,
+        K_PORT = 53,
+        K_QUERY_TIMEOUT = 5,
+        K_MAX_TRIES = 3
     };
 
     char dns_servers[K_MAX_DNS_SERVER_COUNT][K_MAX_DNS_SERVER_SIZE];
     int dns_server_count;
 
+    //Query ids are read from it
+    int random_fd;
+    DNSQuery *pending_head;
+
 public:
+    enum
+    {
+        T_A = 1,
+        T_MX = 15
+    };
+
     DNSMXResolver();
     ~DNSMXResolver();
 
     int Init();
 
-    char* GetMXWithLowestPreference(const char *host);
+    //The query is sent right away, the caller watches query->done
+    DNSQuery* StartQuery(const char *host, int type);
+    //Drops the query whether it is done or still pending
+    void ReleaseQuery(DNSQuery *query);
+
+    //Adds the sockets of the pending queries
+    void GetFds(fd_set &read_fds, int &max_fd) const;
+    void HandleReplies(const fd_set &read_fds);
+    //Sends the timed out queries again or gives them up
+    void CheckTimeouts(time_t now);
+    //When the first pending try times out, -1 if there are none
+    time_t GetNextDeadline() const;
 
 private:
     int GetDNSServers();
-    void ChangetoDNSNameFormat(unsigned char *dns, unsigned char *host);
-    unsigned char* ReadName(
-        unsigned char* reader,
-        unsigned char* buffer, 
-        int &count
-    );
+    int SendQuery(DNSQuery *query);
+    //Reads what came to the query's socket
+    void ReadReplies(DNSQuery *query);
+    //False if the reply is not the answer to the query
+    bool ParseReply(DNSQuery *query, const unsigned char *buf, int len);
+    //A random id no pending query has
+    unsigned short MakeId();
+    void FinishQuery(DNSQuery *query, int status);
 
+    static int ExpandName(
+        const unsigned char *buf, int len,
+        int pos,
+        char *name
+    );
+    static int SkipName(const unsigned char *buf, int len, int pos);
 };
 
 extern DNSMXResolver dns_mx_resolver;
 
-#endif
\ No newline at end of file
+#endif
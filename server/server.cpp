@@ -44,8 +44,8 @@ AbstractServer::~AbstractServer()
         close(main_socket);
     
     for (int i = 0; i < max_user_count; i++) {
-        if (user_socket >= 0) 
-            close(i);
+        if (user_socket[i] >= 0) 
+            close(user_socket[i]);
     }
     delete [] user_socket;
     
@@ -300,6 +300,9 @@ int MailServer::DisconnectUser(int user_idx) {
     user_ip_address[user_idx] = 0;
     user_socket[user_idx] = -1;
     user_count--;
+
+    delete user_session[user_idx];
+    user_session[user_idx] = 0;
     
     return 0;
 }
@@ -326,7 +329,7 @@ void MailServer::HandleInData(int user_idx)
         case 0:
             user_session[user_idx]->RemoteEOT();
             DisconnectUser(user_idx);
-            break;
+            return;
         default:
             user_session[user_idx]->EatReceivedData(buf, buflen);
     }
@@ -361,3 +364,37 @@ void MailServer::HandleOutData(int user_idx)
         DisconnectUser(user_idx);
     }
 }
+
+void MailServer::HandleCommittedMessages()
+{
+    SpoolCommitTicket *ticket = spool_committer->Reap();
+    while (ticket) {
+        SpoolCommitTicket *next = ticket->next;
+        Message *message = ticket->message;
+
+        int code = 250;
+        if (ticket->status < 0) {
+            write_log(
+                "[SMTP-DAEMON] %s message could not be committed to spool\n",
+                message->GetId()
+            );
+            message->DeleteMessage();
+            delete message;
+            code = 451;
+        } else if (mail_queue->AddMessage(message) < 0) {
+            write_log(
+                "[SMTP-DAEMON] %s message could not add to queue\n", 
+                message->GetId()
+            );
+            message->DeleteMessage();
+            delete message;
+            code = 451;
+        }
+
+        if (ticket->owner)
+            ((SMTPProtocolServerSession*)ticket->owner)->CommitDone(code);
+
+        delete ticket;
+        ticket = next;
+    }
+}
@@ -73,6 +73,10 @@ public:
     virtual int DisconnectUser(int user_idx);
     virtual void HandleInData(int user_idx);
     virtual void HandleOutData(int user_idx);
+
+    //Queues the messages the spool committer has made durable
+    //and releases the held back DATA replies
+    void HandleCommittedMessages();
     
 private:
     
@@ -0,0 +1,990 @@
+#include "smtpclient.h"
+#include "mailqueue.h"
+#include "daemon.h"
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+SMTPClientSession::SMTPClientSession(
+    Message *a_message,
+    const char *a_domain,
+    const char *a_local_domain,
+    const int *a_recipients,
+    int a_recipients_count,
+    DeliveryLimits *a_limits,
+    ConnectionCache *a_cache,
+    DomainQueue *a_domain_queue,
+    DestinationHealth *a_health,
+    RelayHosts *a_relay
+)
+{
+    state = st_wait_domain;
+
+    message = a_message;
+    domain = strdup(a_domain);
+    local_domain = a_local_domain;
+
+    recipients_count = a_recipients_count;
+    recipients = new int [recipients_count];
+    recipients_status = new int [recipients_count];
+    recipients_defer = new int [recipients_count];
+    for (int i = 0; i < recipients_count; i++) {
+        recipients[i] = a_recipients[i];
+        recipients_status[i] = Message::rcpt_pending;
+        recipients_defer[i] = Message::defer_connection;
+    }
+    rcpt_idx = 0;
+    accepted_count = 0;
+
+    limits = a_limits;
+    cache = a_cache;
+    domain_queue = a_domain_queue;
+    queued = false;
+    health = a_health;
+    relay = a_relay;
+    holds_domain = false;
+    mx_address = 0;
+    holds_address = false;
+
+    query = 0;
+    mx_hosts = 0;
+    mx_count = mx_idx = 0;
+    mx_host = 0;
+    addresses = 0;
+    address_count = address_idx = 0;
+    address.s_addr = 0;
+    port = 25;
+    relay_order = 0;
+
+    sock_fd = -1;
+    connect_start.tv_sec = connect_start.tv_usec = 0;
+    connect_ms = 0;
+    answered = false;
+    reused = false;
+    connection_messages = 0;
+    capabilities = 0;
+    pipelined = false;
+
+    body_fd = -1;
+    body_offset = 0;
+    body_left = 0;
+    corked = false;
+
+    write_calls = 0;
+
+    deadline = 0;
+    delivered = false;
+}
+
+SMTPClientSession::~SMTPClientSession()
+{
+    if (queued)
+        domain_queue->Remove(this);
+    CloseConnection();
+
+    if (query)
+        dns_mx_resolver.ReleaseQuery(query);
+    if (mx_hosts) {
+        for (int i = 0; i < mx_count; i++)
+            free((void*)mx_hosts[i]);
+        delete [] mx_hosts;
+    }
+    if (relay_order)
+        delete [] relay_order;
+    if (mx_host)
+        free((void*)mx_host);
+    if (addresses)
+        delete [] addresses;
+    if (mx_address)
+        free((void*)mx_address);
+    free((void*)domain);
+
+    delete [] recipients;
+    delete [] recipients_status;
+    delete [] recipients_defer;
+}
+
+int SMTPClientSession::Start()
+{
+    Step();
+
+    return state == st_done && !delivered ? -1: 0;
+}
+
+void SMTPClientSession::Resume()
+{
+    if (state == st_wait_address)
+        Step();
+}
+
+bool SMTPClientSession::IsWaiting() const
+{
+    return state == st_wait_domain || state == st_wait_address;
+}
+
+
+
+int SMTPClientSession::GetFd() const { return sock_fd; }
+
+bool SMTPClientSession::WantsRead() const
+{
+    return sock_fd >= 0 && state != st_connecting;
+}
+
+bool SMTPClientSession::WantsWrite() const
+{
+    return sock_fd >= 0 &&
+        (state == st_connecting || state == st_body || outbuf.Length() > 0);
+}
+
+time_t SMTPClientSession::GetDeadline() const
+{
+    // the resolver keeps its own timeouts
+    return sock_fd >= 0 ? deadline: -1;
+}
+
+void SMTPClientSession::HandleIO(bool readable, bool writable)
+{
+    if (state == st_connecting) {
+        if (!writable)
+            return;
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err) {
+            Fail(strerror(err));
+            return;
+        }
+
+        // a descriptor reused since select() may look ready too early
+        sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(sock_fd, (sockaddr*)&peer, &peer_len) < 0)
+            return;
+
+        timeval now;
+        gettimeofday(&now, 0);
+        connect_ms = (now.tv_sec - connect_start.tv_sec) * 1000 +
+            (now.tv_usec - connect_start.tv_usec) / 1000;
+
+        state = st_greeting;
+        SetDeadline(server_options.command_timeout);
+        return;
+    }
+
+    if (writable) {
+        FlushOut();
+        if (state == st_body && !outbuf.Length())
+            SendBody();
+    }
+
+    if (readable && state != st_done)
+        ReadReplies();
+}
+
+void SMTPClientSession::CheckTimeout(time_t now)
+{
+    if (state == st_resolve_mx || state == st_resolve_host ||
+        state == st_wait_address) {
+        Step();
+        return;
+    }
+
+    // the domain queue wakes the session, it has no deadline
+    if (state == st_wait_domain || state == st_done || now < deadline)
+        return;
+
+    // the message is already accepted, the QUIT reply does not matter
+    if (state == st_quit) {
+        Finish();
+        return;
+    }
+
+    Fail("timed out");
+}
+
+bool SMTPClientSession::IsFinished() const { return state == st_done; }
+
+bool SMTPClientSession::IsDelivered() const { return delivered; }
+
+int SMTPClientSession::GetSyscallCount() const
+{
+    return write_calls + replies.GetReadCalls();
+}
+
+Message* SMTPClientSession::GetMessage() const { return message; }
+
+const char* SMTPClientSession::GetDomain() const { return domain; }
+
+int SMTPClientSession::GetRecipientsCount() const { return recipients_count; }
+
+int SMTPClientSession::GetRecipient(int idx) const { return recipients[idx]; }
+
+int SMTPClientSession::GetRecipientStatus(int idx) const
+{
+    return recipients_status[idx];
+}
+
+int SMTPClientSession::GetRecipientDefer(int idx) const
+{
+    return recipients_defer[idx];
+}
+
+
+
+void SMTPClientSession::Step()
+{
+    if (state == st_wait_domain) {
+        if (health->IsOpen(domain, time(0))) {
+            Skip(domain);
+            return;
+        }
+        // the smarthosts share one pool of connections
+        bool acquired = relay ?
+            limits->AcquireDomain(domain, relay->GetMaxConnections()):
+            limits->AcquireDomain(domain);
+        if (!acquired) {
+            if (!queued) {
+                domain_queue->Push(this);
+                queued = true;
+            }
+            return;
+        }
+        holds_domain = true;
+
+        if (relay) {
+            mx_count = relay->GetCount();
+            relay_order = new int [mx_count];
+            relay->GetOrder(relay_order, limits, cache, health, time(0));
+            mx_idx = 0;
+            UseRelayHost();
+            return;
+        }
+
+        query = dns_mx_resolver.StartQuery(domain, DNSMXResolver::T_MX);
+        state = st_resolve_mx;
+    }
+
+    if (state == st_wait_address) {
+        // a cached connection brings its address slot along
+        sock_fd = cache->Take(mx_address, connection_messages, capabilities);
+        if (sock_fd >= 0) {
+            holds_address = true;
+            reused = true;
+            state = st_rset;
+            SendCommand("RSET", 0);
+            return;
+        }
+
+        bool acquired = relay ?
+            limits->AcquireAddress(mx_address, relay->GetMaxHostConnections()):
+            limits->AcquireAddress(mx_address);
+        if (!acquired)
+            return;
+        holds_address = true;
+
+        if (Connect() < 0)
+            Fail(strerror(errno));
+        return;
+    }
+
+    if (!query || !query->done)
+        return;
+
+    int status = query->status;
+
+    if (state == st_resolve_mx) {
+        if (status < 0) {
+            health->Failure(domain, "MX lookup failed", time(0));
+            Fail("MX lookup failed");
+            return;
+        }
+
+        // a domain without MX records is its own exchange
+        if (status == 0) {
+            mx_count = query->mx_count;
+            mx_hosts = new char* [mx_count];
+            for (int i = 0; i < mx_count; i++)
+                mx_hosts[i] = strdup(query->mx_hosts[i]);
+        } else {
+            mx_count = 1;
+            mx_hosts = new char* [1];
+            mx_hosts[0] = strdup(domain);
+        }
+        dns_mx_resolver.ReleaseQuery(query);
+        query = 0;
+
+        mx_idx = 0;
+        ResolveHost();
+        return;
+    }
+
+    if (state == st_resolve_host) {
+        if (status == 0) {
+            address_count = query->address_count;
+            addresses = new in_addr [address_count];
+            memcpy(addresses, query->addresses, address_count * sizeof(in_addr));
+        }
+        dns_mx_resolver.ReleaseQuery(query);
+        query = 0;
+
+        if (status != 0) {
+            if (NextExchange())
+                return;
+            health->Failure(domain, "no address for the exchange", time(0));
+            Fail("no address for the exchange");
+            return;
+        }
+
+        address_idx = 0;
+        TryAddress();
+    }
+}
+
+void SMTPClientSession::ResolveHost()
+{
+    if (mx_host)
+        free((void*)mx_host);
+    mx_host = strdup(mx_hosts[mx_idx]);
+
+    query = dns_mx_resolver.StartQuery(mx_host, DNSMXResolver::T_A);
+    state = st_resolve_host;
+    Step();
+}
+
+void SMTPClientSession::UseRelayHost()
+{
+    const RelayHost *host = relay->GetHost(relay_order[mx_idx]);
+
+    if (mx_host)
+        free((void*)mx_host);
+    mx_host = strdup(host->name);
+
+    if (!addresses)
+        addresses = new in_addr [1];
+    addresses[0] = host->address;
+    address_count = 1;
+    address_idx = 0;
+    port = host->port;
+
+    TryAddress();
+}
+
+void SMTPClientSession::TryAddress()
+{
+    address = addresses[address_idx];
+    if (mx_address)
+        free((void*)mx_address);
+    mx_address = RelayHosts::MakeKey(address, port);
+
+    if (health->IsOpen(mx_address, time(0))) {
+        if (!NextExchange())
+            Skip(mx_address);
+        return;
+    }
+
+    state = st_wait_address;
+    Step();
+}
+
+bool SMTPClientSession::NextExchange()
+{
+    if (address_idx + 1 < address_count) {
+        address_idx++;
+        TryAddress();
+        return true;
+    }
+
+    if (mx_idx + 1 < mx_count) {
+        if (addresses)
+            delete [] addresses;
+        addresses = 0;
+        address_count = address_idx = 0;
+
+        mx_idx++;
+        if (relay)
+            UseRelayHost();
+        else
+            ResolveHost();
+        return true;
+    }
+
+    return false;
+}
+
+int SMTPClientSession::Connect()
+{
+    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd < 0)
+        return -1;
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = address;
+
+    // a refusal right away is the exchange's as well
+    state = st_connecting;
+    answered = false;
+    connect_ms = 0;
+    gettimeofday(&connect_start, 0);
+    if (connect(sock_fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != EINPROGRESS)
+            return -1;
+
+        SetDeadline(server_options.connect_timeout);
+        return 0;
+    }
+
+    state = st_greeting;
+    SetDeadline(server_options.command_timeout);
+    return 0;
+}
+
+void SMTPClientSession::FlushOut()
+{
+    while (outbuf.Length() > 0) {
+        int written = send(
+            sock_fd, outbuf.GetBuffer(), outbuf.Length(), MSG_NOSIGNAL
+        );
+        write_calls++;
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                Fail(strerror(errno));
+            return;
+        }
+        outbuf.DropData(written);
+    }
+
+    // the final dot is out, whatever the cork held goes with it
+    if (corked && state == st_dot)
+        SetCork(false);
+}
+
+void SMTPClientSession::SendBody()
+{
+    // the spooled data is already in wire format, the kernel copies
+    // it from the page cache to the socket
+    while (body_left > 0) {
+        ssize_t sent = sendfile(sock_fd, body_fd, &body_offset, body_left);
+        write_calls++;
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                Fail(strerror(errno));
+            return;
+        }
+        if (sent == 0) {
+            Fail("spool record is shorter than its header says");
+            return;
+        }
+        body_left -= sent;
+    }
+
+    close(body_fd);
+    body_fd = -1;
+
+    outbuf.AddString(".\r\n");
+    state = st_dot;
+    SetDeadline(server_options.data_timeout);
+    FlushOut();
+}
+
+void SMTPClientSession::ReadReplies()
+{
+    int status = replies.Fill(sock_fd);
+    if (status < 0) {
+        Fail(strerror(errno));
+        return;
+    }
+
+    SMTPReply reply;
+    while (state != st_done) {
+        int res = replies.Next(reply);
+        if (res < 0) {
+            Fail("malformed reply");
+            return;
+        }
+        if (res == 0)
+            break;
+
+        HandleReply(reply);
+    }
+
+    if (status == 0 && state != st_done) {
+        if (state == st_quit)
+            Finish();
+        else
+            Fail("connection closed by the server");
+    }
+}
+
+void SMTPClientSession::HandleReply(const SMTPReply &reply)
+{
+    int klass = reply.code / 100;
+
+    switch (state) {
+        case st_rset:
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            StartTransaction();
+            break;
+        case st_greeting:
+            // whatever it says, the exchange is up
+            answered = true;
+            health->Success(mx_address, connect_ms);
+            health->Success(domain, connect_ms);
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            state = st_ehlo;
+            SendCommand("EHLO", local_domain);
+            break;
+        case st_ehlo:
+            // servers that know no extensions still take HELO
+            if (klass == 5) {
+                capabilities = 0;
+                state = st_helo;
+                SendCommand("HELO", local_domain);
+                break;
+            }
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            AddCapabilities(reply.text);
+            StartTransaction();
+            break;
+        case st_helo:
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            StartTransaction();
+            break;
+        case st_mail:
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            rcpt_idx = 0;
+            state = st_rcpt;
+            if (!pipelined) {
+                SendAddress(
+                    "RCPT TO:",
+                    message->GetRecipientsAddress()[recipients[rcpt_idx]]
+                );
+            }
+            break;
+        case st_rcpt:
+            // accepted recipients count as delivered only once the
+            // data is accepted, refused ones are not tried again
+            if (klass == 2) {
+                recipients_status[rcpt_idx] = Message::rcpt_delivered;
+                accepted_count++;
+            } else if (klass == 5) {
+                write_log(
+                    "[SMTP-DAEMON] Message %s recipient %s refused: %d %s\n",
+                    message->GetId(),
+                    message->GetRecipientsAddress()[recipients[rcpt_idx]],
+                    reply.code,
+                    reply.text
+                );
+                recipients_status[rcpt_idx] = Message::rcpt_failed;
+            } else {
+                write_log(
+                    "[SMTP-DAEMON] Message %s recipient %s deferred: %d %s\n",
+                    message->GetId(),
+                    message->GetRecipientsAddress()[recipients[rcpt_idx]],
+                    reply.code,
+                    reply.text
+                );
+                recipients_defer[rcpt_idx] = Message::defer_reply;
+            }
+
+            if (++rcpt_idx < recipients_count) {
+                if (!pipelined) {
+                    SendAddress(
+                        "RCPT TO:",
+                        message->GetRecipientsAddress()[recipients[rcpt_idx]]
+                    );
+                }
+            } else if (pipelined) {
+                // DATA is already on its way
+                state = st_data;
+            } else if (accepted_count > 0) {
+                state = st_data;
+                SendCommand("DATA", 0);
+            } else {
+                EndTransaction();
+            }
+            break;
+        case st_data:
+            // a pipelined DATA can be let in after every recipient
+            // was refused, an empty message closes it again
+            if (accepted_count == 0) {
+                if (klass == 3) {
+                    outbuf.AddString(".\r\n");
+                    state = st_dot;
+                    SetDeadline(server_options.data_timeout);
+                    FlushOut();
+                } else {
+                    EndTransaction();
+                }
+                break;
+            }
+            if (klass != 3) {
+                Fail(reply);
+                return;
+            }
+
+            body_fd = open(message->GetSpoolPath(), O_RDONLY);
+            if (body_fd < 0) {
+                Fail(strerror(errno));
+                return;
+            }
+            body_offset = message->GetBodyOffset();
+            body_left = message->GetBodyLength();
+
+            // the body and the final dot leave in full segments
+            SetCork(true);
+            state = st_body;
+            SetDeadline(server_options.data_timeout);
+            SendBody();
+            break;
+        case st_dot:
+            if (accepted_count == 0) {
+                EndTransaction();
+                break;
+            }
+            if (klass != 2) {
+                Fail(reply);
+                return;
+            }
+            delivered = true;
+            EndTransaction();
+            break;
+        case st_quit:
+            Finish();
+            break;
+        default:
+            // nothing was asked in the middle of the data
+            Fail(reply);
+            break;
+    }
+}
+
+
+
+void SMTPClientSession::AddCapabilities(const char *text)
+{
+    // one keyword per line, the first line carries the server name
+    const char *line = strchr(text, '\n');
+    while (line) {
+        line++;
+
+        int len = 0;
+        while (line[len] && line[len] != ' ' && line[len] != '\n')
+            len++;
+
+        if (len == 10 && !strncasecmp(line, "PIPELINING", len))
+            capabilities |= cap_pipelining;
+
+        line = strchr(line, '\n');
+    }
+}
+
+void SMTPClientSession::StartTransaction()
+{
+    pipelined = (capabilities & cap_pipelining) != 0;
+    rcpt_idx = 0;
+    accepted_count = 0;
+
+    AddAddress("MAIL FROM:", message->GetSenderAddress());
+    if (pipelined) {
+        // one write, the replies are matched back in order
+        for (int i = 0; i < recipients_count; i++) {
+            AddAddress(
+                "RCPT TO:",
+                message->GetRecipientsAddress()[recipients[i]]
+            );
+        }
+        AddCommand("DATA", 0);
+    }
+    state = st_mail;
+
+    SetDeadline(server_options.command_timeout);
+    FlushOut();
+}
+
+void SMTPClientSession::SendCommand(const char *comm, const char *arg)
+{
+    AddCommand(comm, arg);
+    SetDeadline(server_options.command_timeout);
+    FlushOut();
+}
+
+void SMTPClientSession::SendAddress(const char *comm, const char *addr)
+{
+    AddAddress(comm, addr);
+    SetDeadline(server_options.command_timeout);
+    FlushOut();
+}
+
+void SMTPClientSession::AddCommand(const char *comm, const char *arg)
+{
+    outbuf.AddString(comm);
+    if (arg) {
+        outbuf.AddChar(' ');
+        outbuf.AddString(arg);
+    }
+    outbuf.AddString("\r\n");
+}
+
+void SMTPClientSession::AddAddress(const char *comm, const char *addr)
+{
+    outbuf.AddString(comm);
+    outbuf.AddString(" <");
+    outbuf.AddString(addr);
+    outbuf.AddString(">\r\n");
+}
+
+void SMTPClientSession::SetDeadline(int timeout)
+{
+    deadline = time(0) + timeout;
+}
+
+void SMTPClientSession::SetCork(bool on)
+{
+    int value = on ? 1: 0;
+    if (!setsockopt(sock_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)))
+        corked = on;
+    write_calls++;
+}
+
+
+
+void SMTPClientSession::EndTransaction()
+{
+    connection_messages++;
+
+    bool clean = !outbuf.Length() && replies.IsEmpty();
+    int max_messages = server_options.connection_max_messages;
+    if (clean && (max_messages <= 0 || connection_messages < max_messages)) {
+        SMTPClientSession *next = domain_queue->Claim(domain);
+        if (next) {
+            next->TakeConnection(this);
+            Finish();
+            return;
+        }
+    }
+
+    if (clean &&
+        cache->Put(mx_address, sock_fd, connection_messages, capabilities)) {
+        sock_fd = -1;
+        holds_address = false;
+        Finish();
+        return;
+    }
+
+    state = st_quit;
+    SendCommand("QUIT", 0);
+}
+
+void SMTPClientSession::TakeConnection(SMTPClientSession *prev)
+{
+    queued = false;
+
+    // the domain slot goes along, nobody else is woken for it
+    holds_domain = prev->holds_domain;
+    prev->holds_domain = false;
+    holds_address = prev->holds_address;
+    prev->holds_address = false;
+
+    mx_host = strdup(prev->mx_host);
+    mx_address = strdup(prev->mx_address);
+    address = prev->address;
+    port = prev->port;
+
+    sock_fd = prev->sock_fd;
+    prev->sock_fd = -1;
+    reused = true;
+    connection_messages = prev->connection_messages;
+    capabilities = prev->capabilities;
+
+    // the last transaction is over, no RSET is needed
+    StartTransaction();
+}
+
+bool SMTPClientSession::Reconnect()
+{
+    // a connection taken over may have been closed by the server
+    // since, that is found out by the first command sent over it
+    if (!reused || (state != st_rset && state != st_mail))
+        return false;
+
+    shutdown(sock_fd, 2);
+    close(sock_fd);
+    sock_fd = -1;
+    outbuf.DropAll();
+    replies.Reset();
+
+    reused = false;
+    connection_messages = 0;
+    capabilities = 0;
+    for (int i = 0; i < recipients_count; i++)
+        recipients_defer[i] = Message::defer_connection;
+
+    return Connect() == 0;
+}
+
+void SMTPClientSession::Finish()
+{
+    CloseConnection();
+    state = st_done;
+}
+
+void SMTPClientSession::Fail(const char *reason)
+{
+    // no answer from the exchange counts against it, and against its
+    // domain once there is no other exchange or address left to try
+    if ((state == st_connecting || state == st_greeting) && !answered) {
+        time_t now = time(0);
+        health->Failure(mx_address, reason, now);
+
+        write_log(
+            "[SMTP-DAEMON] Message %s exchange %s (%s) did not answer: %s\n",
+            message->GetId(),
+            mx_host,
+            mx_address,
+            reason
+        );
+        DropConnection();
+        if (NextExchange())
+            return;
+        health->Failure(domain, reason, now);
+    }
+
+    // the address slot is still held, the new connection uses it
+    if (Reconnect())
+        return;
+
+    write_log(
+        "[SMTP-DAEMON] Message %s delivery to %s (%s) failed: %s\n",
+        message->GetId(),
+        domain,
+        mx_host ? mx_host: "no exchange",
+        reason
+    );
+
+    // recipients accepted before the failure are tried again
+    if (!delivered) {
+        for (int i = 0; i < recipients_count; i++) {
+            if (recipients_status[i] == Message::rcpt_delivered)
+                recipients_status[i] = Message::rcpt_pending;
+        }
+    }
+
+    CloseConnection();
+    state = st_done;
+}
+
+void SMTPClientSession::Fail(const SMTPReply &reply)
+{
+    // a refused sender is an answer, the connection is not to blame,
+    // and it is refused for every recipient of the transaction
+    if (state == st_mail && reply.code / 100 == 5) {
+        reused = false;
+        for (int i = 0; i < recipients_count; i++)
+            recipients_status[i] = Message::rcpt_failed;
+    }
+
+    // the server is there and asks to come back later
+    if (reply.code / 100 == 4) {
+        for (int i = 0; i < recipients_count; i++)
+            recipients_defer[i] = Message::defer_reply;
+    }
+
+    char *reason = new char [strlen(reply.text) + 8];
+    sprintf(reason, "%d %s", reply.code, reply.text);
+    Fail(reason);
+    delete [] reason;
+}
+
+void SMTPClientSession::Skip(const char *name)
+{
+    const char *error = health->GetLastError(name);
+    char *reason = new char [strlen(name) + (error ? strlen(error): 0) + 32];
+    sprintf(reason, "%s is failing (%s)", name, error ? error: "unknown");
+    Fail(reason);
+    delete [] reason;
+}
+
+void SMTPClientSession::CloseConnection()
+{
+    DropConnection();
+
+    if (holds_domain) {
+        limits->ReleaseDomain(domain);
+        holds_domain = false;
+        WakeNext();
+    }
+}
+
+void SMTPClientSession::DropConnection()
+{
+    if (holds_address) {
+        limits->ReleaseAddress(mx_address);
+        holds_address = false;
+    }
+
+    if (body_fd >= 0) {
+        close(body_fd);
+        body_fd = -1;
+    }
+
+    if (sock_fd >= 0) {
+        shutdown(sock_fd, 2);
+        close(sock_fd);
+        sock_fd = -1;
+    }
+
+    outbuf.DropAll();
+    replies.Reset();
+    corked = false;
+}
+
+void SMTPClientSession::WakeNext()
+{
+    // a session skipped because the domain is failing leaves the slot
+    // free, the next one is tried then
+    SMTPClientSession *next;
+    while ((next = domain_queue->Claim(domain))) {
+        next->queued = false;
+        next->Step();
+        if (next->state != st_done)
+            break;
+    }
+}
@@ -0,0 +1,216 @@
+#ifndef SMTPCLIENT_H_SENTRY
+#define SMTPCLIENT_H_SENTRY
+
+#include "buffer.h"
+#include "resolve.h"
+#include "deliverylimits.h"
+#include "connectioncache.h"
+#include "domainqueue.h"
+#include "destinationhealth.h"
+#include "relayhosts.h"
+#include "smtpreply.h"
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+class Message;
+
+// One outbound transaction: the recipients of one message that live
+// in one domain. Nothing here blocks, the main loop calls HandleIO
+// whenever the descriptor is ready and CheckTimeout once per pass,
+// every phase has its own deadline. A session waits without a
+// deadline while its domain or its exchange address is at the limit,
+// in the domain queue in the first case. A session that ends its
+// transaction cleanly passes the connection straight to the next one
+// queued for the domain, otherwise a connection left idle by an
+// earlier transaction to the same address is taken from the cache.
+// When the mail is relayed the smarthosts take the place of the
+// exchanges and no lookup is made.
+class SMTPClientSession
+{
+    enum {
+        st_wait_domain,
+        st_resolve_mx,
+        st_resolve_host,
+        st_wait_address,
+        st_connecting,
+        st_rset,
+        st_greeting,
+        st_ehlo,
+        st_helo,
+        st_mail,
+        st_rcpt,
+        st_data,
+        st_body,
+        st_dot,
+        st_quit,
+        st_done
+    } state;
+
+    Message *message;
+    char *domain;
+    const char *local_domain;
+
+    //Indices into the message recipients and what became of each
+    int *recipients;
+    int *recipients_status;
+    //Message::defer_* for the ones left pending
+    int *recipients_defer;
+    int recipients_count;
+    int rcpt_idx;
+    int accepted_count;
+
+    DeliveryLimits *limits;
+    ConnectionCache *cache;
+    DomainQueue *domain_queue;
+    bool queued;
+    DestinationHealth *health;
+    //0 unless the mail goes through the smarthosts
+    RelayHosts *relay;
+    bool holds_domain;
+    //Exchange address in dotted form once it is known
+    char *mx_address;
+    bool holds_address;
+
+    DNSQuery *query;
+    //Exchanges of the domain by preference and the addresses of the
+    //one being tried, they are gone through until one answers
+    char **mx_hosts;
+    int mx_count, mx_idx;
+    char *mx_host;
+    in_addr *addresses;
+    int address_count, address_idx;
+    in_addr address;
+    int port;
+    //Smarthosts in the order they are tried, in place of mx_hosts
+    int *relay_order;
+
+    enum {
+        cap_pipelining = 0x01
+    };
+
+    int sock_fd;
+    //When the connect started and how long it took
+    timeval connect_start;
+    long connect_ms;
+    //The exchange said something over the connection
+    bool answered;
+    //The connection came from the cache, with that many transactions
+    bool reused;
+    int connection_messages;
+    //Extensions the server announced in its EHLO reply
+    int capabilities;
+    //MAIL, RCPT and DATA went out in one batch
+    bool pipelined;
+    InoutBuffer outbuf;
+    SMTPReplyReader replies;
+
+    int body_fd;
+    off_t body_offset;
+    long body_left;
+    //TCP_CORK is on from the start of the body to the final dot
+    bool corked;
+
+    //send() and sendfile() calls, the reads are counted by the reader
+    int write_calls;
+
+    time_t deadline;
+    bool delivered;
+
+public:
+    SMTPClientSession(
+        Message *a_message,
+        const char *a_domain,
+        const char *a_local_domain,
+        const int *a_recipients,
+        int a_recipients_count,
+        DeliveryLimits *a_limits,
+        ConnectionCache *a_cache,
+        DomainQueue *a_domain_queue,
+        DestinationHealth *a_health,
+        RelayHosts *a_relay
+    );
+    ~SMTPClientSession();
+
+    //Starts with the MX lookup as soon as the domain has a free slot,
+    //-1 if it could not even start
+    int Start();
+    //Retries a session waiting for an address after some connection
+    //or address slot was released, the domain queue wakes the others
+    void Resume();
+    bool IsWaiting() const;
+
+    //-1 while no socket is open
+    int GetFd() const;
+    bool WantsRead() const;
+    bool WantsWrite() const;
+    time_t GetDeadline() const;
+
+    void HandleIO(bool readable, bool writable);
+    void CheckTimeout(time_t now);
+
+    bool IsFinished() const;
+    //True once the message was accepted for at least one recipient
+    bool IsDelivered() const;
+
+    //Socket reads and writes the transaction took
+    int GetSyscallCount() const;
+
+    Message* GetMessage() const;
+    const char* GetDomain() const;
+    int GetRecipientsCount() const;
+    //Index of the recipient inside the message
+    int GetRecipient(int idx) const;
+    //Message::rcpt_* status the transaction left the recipient in
+    int GetRecipientStatus(int idx) const;
+    int GetRecipientDefer(int idx) const;
+
+private:
+    void Step();
+    void ResolveHost();
+    void UseRelayHost();
+    void TryAddress();
+    //Moves on to the next address or exchange, false if none is left
+    bool NextExchange();
+    int Connect();
+    void FlushOut();
+    void SendBody();
+    void ReadReplies();
+    void HandleReply(const SMTPReply &reply);
+    void AddCapabilities(const char *text);
+    //Sends MAIL FROM, then RCPT TO and DATA as well if the server
+    //takes them pipelined
+    void StartTransaction();
+
+    //A failed send fails the session at once, so the state the reply
+    //is expected in is set before these are called
+    void SendCommand(const char *comm, const char *arg);
+    void SendAddress(const char *comm, const char *addr);
+    //The same, but only queued until the next flush
+    void AddCommand(const char *comm, const char *arg);
+    void AddAddress(const char *comm, const char *addr);
+    void SetDeadline(int timeout);
+    void SetCork(bool on);
+
+    //Passes the connection on to the next session for the domain,
+    //parks it in the cache or says QUIT
+    void EndTransaction();
+    //Goes on with the connection and the slots of a session that
+    //just ended its transaction to the same domain
+    void TakeConnection(SMTPClientSession *prev);
+    //The first session queued for the domain gets the slot given up
+    void WakeNext();
+    //A cached connection that turned out dead is replaced by a new one
+    bool Reconnect();
+    void Finish();
+    void Fail(const char *reason);
+    void Fail(const SMTPReply &reply);
+    //Gives up without trying, the destination is known to be failing
+    void Skip(const char *name);
+    void CloseConnection();
+    //The socket and the address slot only, the domain slot is kept
+    void DropConnection();
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include "smtpreply.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+SMTPReplyReader::SMTPReplyReader()
+{
+    data_size = K_INITIAL_SIZE;
+    data = new char [data_size];
+    data_start = data_length = 0;
+
+    text_size = K_INITIAL_SIZE;
+    text = new char [text_size];
+    text[0] = '\0';
+
+    read_calls = 0;
+}
+
+SMTPReplyReader::~SMTPReplyReader()
+{
+    delete [] data;
+    delete [] text;
+}
+
+int SMTPReplyReader::Fill(int fd)
+{
+    for (;;) {
+        Compact();
+        if (data_length == data_size) {
+            if (data_size >= K_MAX_SIZE) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            char *new_data = new char [2 * data_size];
+            memcpy(new_data, data, data_length);
+            delete [] data;
+            data = new_data;
+            data_size *= 2;
+        }
+
+        int space = data_size - data_length;
+        int len = read(fd, data + data_length, space);
+        read_calls++;
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+        if (len == 0)
+            return 0;
+
+        data_length += len;
+
+        // a short read drained the socket, asking again would only
+        // return EAGAIN
+        if (len < space)
+            return 1;
+    }
+}
+
+int SMTPReplyReader::Next(SMTPReply &reply)
+{
+    // the whole reply has to be there before any of it is taken
+    int pos = data_start;
+    int line_count = 0;
+    int text_length = 0;
+    for (;;) {
+        int end = FindLineEnd(pos);
+        if (end < 0)
+            return 0;
+
+        const char *line = data + pos;
+        int line_len = end - pos;
+        while (line_len > 0 &&
+            (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+            line_len--;
+
+        if (line_len < 3 ||
+            line[0] < '1' || line[0] > '5' ||
+            line[1] < '0' || line[1] > '9' ||
+            line[2] < '0' || line[2] > '9' ||
+            (line_len > 3 && line[3] != ' ' && line[3] != '-'))
+            return -1;
+
+        int code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + line[2] - '0';
+        if (line_count == 0) {
+            reply.code = code;
+            ParseEnhancedStatus(line, reply);
+        } else if (code != reply.code) {
+            return -1;
+        }
+        line_count++;
+
+        // "250-" and "250 " are followed by the text, "250" has none
+        int part_len = line_len > 4 ? line_len - 4: 0;
+        ProvideTextSize(text_length + part_len + 2);
+        if (text_length)
+            text[text_length++] = '\n';
+        memcpy(text + text_length, line + 4, part_len);
+        text_length += part_len;
+        text[text_length] = '\0';
+
+        pos = end;
+        if (line_len <= 3 || line[3] == ' ')
+            break;
+    }
+
+    data_length -= pos - data_start;
+    data_start = pos;
+
+    reply.text = text;
+    reply.line_count = line_count;
+
+    return 1;
+}
+
+bool SMTPReplyReader::IsEmpty() const { return data_length == 0; }
+
+int SMTPReplyReader::GetReadCalls() const { return read_calls; }
+
+void SMTPReplyReader::Reset()
+{
+    data_start = data_length = 0;
+    text[0] = '\0';
+}
+
+
+
+int SMTPReplyReader::FindLineEnd(int pos) const
+{
+    const char *end = (const char*)memchr(
+        data + pos, '\n', data_start + data_length - pos
+    );
+    return end ? end - data + 1: -1;
+}
+
+void SMTPReplyReader::Compact()
+{
+    if (data_start == 0)
+        return;
+
+    memmove(data, data + data_start, data_length);
+    data_start = 0;
+}
+
+void SMTPReplyReader::ProvideTextSize(int n)
+{
+    if (n <= text_size)
+        return;
+
+    int new_size = text_size;
+    while (new_size < n)
+        new_size *= 2;
+
+    char *new_text = new char [new_size];
+    memcpy(new_text, text, text_size);
+    delete [] text;
+    text = new_text;
+    text_size = new_size;
+}
+
+void SMTPReplyReader::ParseEnhancedStatus(const char *line, SMTPReply &reply)
+{
+    // class.subject.detail right after the code, the class matches it
+    reply.enhanced[0] = '\0';
+
+    const char *p = line + 4;
+    if (line[3] == '\0' || line[3] == '\r' || line[3] == '\n' ||
+        p[0] != line[0] || p[1] != '.')
+        return;
+
+    int len = 2, dots = 1;
+    while (len < (int)sizeof(reply.enhanced) - 1) {
+        char c = p[len];
+        if (c == '.' && p[len - 1] != '.' && dots < 2) {
+            dots++;
+        } else if (c < '0' || c > '9') {
+            break;
+        }
+        len++;
+    }
+
+    if (dots != 2 || p[len - 1] == '.' || (p[len] != ' ' && p[len] != '\r' &&
+        p[len] != '\n'))
+        return;
+
+    memcpy(reply.enhanced, p, len);
+    reply.enhanced[len] = '\0';
+}
@@ -0,0 +1,62 @@
+#ifndef SMTPREPLY_H_SENTRY
+#define SMTPREPLY_H_SENTRY
+
+struct SMTPReply
+{
+    int code;
+    //"5.1.1" when the server sent an enhanced status, empty otherwise
+    char enhanced[12];
+    //Text of every line without the code, lines are joined with '\n'.
+    //Points into the reader, valid until its next call
+    const char *text;
+    int line_count;
+};
+
+// Collects whatever a connection has to say and cuts it into whole
+// replies, continuation lines included. One read can serve several
+// pipelined replies, and the buffers are reused from one reply to the
+// next instead of being allocated per reply.
+class SMTPReplyReader
+{
+    enum {
+        K_INITIAL_SIZE = 1024,
+        //A reply that does not fit into this much is taken as garbage
+        K_MAX_SIZE = 64 * 1024
+    };
+
+    char *data;
+    int data_start, data_length, data_size;
+
+    char *text;
+    int text_size;
+
+    int read_calls;
+
+public:
+    SMTPReplyReader();
+    ~SMTPReplyReader();
+
+    //Reads everything the socket has now. 1 if the connection is
+    //still open, 0 if the server closed it (what came before is still
+    //served), -1 on error
+    int Fill(int fd);
+    //1 if a whole reply was taken out, 0 if more data is needed,
+    //-1 if the data is not an SMTP reply
+    int Next(SMTPReply &reply);
+
+    bool IsEmpty() const;
+    void Reset();
+
+    //read() calls made so far
+    int GetReadCalls() const;
+
+private:
+    //Offset just past the end of the line starting at pos, -1 if the
+    //line is not complete yet
+    int FindLineEnd(int pos) const;
+    void Compact();
+    void ProvideTextSize(int n);
+    static void ParseEnhancedStatus(const char *line, SMTPReply &reply);
+};
+
+#endif
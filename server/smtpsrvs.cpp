@@ -11,6 +11,7 @@
 #include "options.h"
 #include "daemon.h"
 #include "header.h"
+#include "mimeindex.h"
 
 #include <iostream>
 #include <fstream>
@@ -77,6 +78,8 @@ SMTPProtocolServerSession::SMTPProtocolServerSession(
         max_recipients_count * sizeof(*recipients_address)
     );
     sender_address = 0;
+    local_recipients = 0;
+    pending_commit = 0;
     
     outbuf.AddString("220 ");
     outbuf.AddString(domain);
@@ -101,6 +104,10 @@ SMTPProtocolServerSession::SMTPProtocolServerSession(
 
 SMTPProtocolServerSession::~SMTPProtocolServerSession()
 {
+    // the message is still committed, just nobody waits for the reply
+    if (pending_commit)
+        pending_commit->owner = 0;
+
     if (domain)
         free((void*)domain);
     if (remote_domain) 
@@ -123,7 +130,8 @@ SMTPProtocolServerSession::~SMTPProtocolServerSession()
 void SMTPProtocolServerSession::HandleNewData()
 {
     InoutBuffer curline;
-    while(inbuf.ReadLine(curline)) {
+    // pipelined commands wait in inbuf until the commit is done
+    while(state != st_committing && inbuf.ReadLine(curline)) {
         switch(state) {
             case st_closed:
                 continue;
@@ -147,6 +155,15 @@ void SMTPProtocolServerSession::RemoteEOT()
     GracefullyClose();
 }
 
+void SMTPProtocolServerSession::CommitDone(int code)
+{
+    pending_commit = 0;
+    DataEndResponse(code);
+    if (state == st_committing)
+        state = st_beforemail;
+    HandleNewData();
+}
+
 void SMTPProtocolServerSession::SetRemoteDomain(const char *s)
 {
     if(remote_domain) free((void*)remote_domain);
@@ -179,6 +196,11 @@ void SMTPProtocolServerSession::ProcessData(const char *line)
             delete [] resp;
         } else {            // SMTP/ESMTP
             int rc = MessageDataEnd();
+            if (rc == 0) {
+                MessageDiscard();
+                state = st_committing;
+                return;
+            }
             DataEndResponse(rc);
         }
         MessageDiscard();
@@ -334,6 +356,7 @@ void SMTPProtocolServerSession::ProcessMailCommand(const char *param)
                     CustomizedReply("250 2.1.0 Sender Ok"); 
                     state = st_recipients;
                     recipients_count = 0;
+                    local_recipients = 0;
                     break;
                 case 421: // Service unavailable, closing connection
                     ServiceUnavailable(); 
@@ -551,6 +574,7 @@ void SMTPProtocolServerSession::MessageDiscard()
         recipients_address[i] = 0;
     }
     recipients_count = 0;
+    local_recipients = 0;
 }
 
 int SMTPProtocolServerSession::MessageStart(const char *a_sender_address) 
@@ -607,11 +631,34 @@ int SMTPProtocolServerSession::MessageAddRecipient(const char *address)
     if (recipients_address[recipients_count][len - 1] == '>')
         recipients_address[recipients_count][len - 1] = '\0';
     
-    if (!strcmp(address + atpos + 1, domain)) {
-        if (user_list->FindUserByAddress(recipients_address[recipients_count]) < 0) {
-            free((void*)recipients_address[recipients_count]);
+    // the domain is taken from the address without its brackets
+    char *rcpt = recipients_address[recipients_count];
+    if (!strcmp(rcpt + FindAtSymbolInAddress(rcpt) + 1, domain)) {
+        int user_idx = user_list->FindUserByAddress(rcpt);
+        if (user_idx < 0) {
+            free((void*)rcpt);
+            recipients_address[recipients_count] = 0;
             return 450;
         }
+        local_recipients = 1;
+
+        // the redirects were flattened when the users were loaded, the
+        // message is queued for where the mail ends up
+        const char *final_address = user_list->GetFinalAddress(user_idx);
+        if (strcmp(final_address, rcpt)) {
+            free((void*)rcpt);
+            rcpt = strdup(final_address);
+            recipients_address[recipients_count] = rcpt;
+        }
+    }
+
+    // aliases of one mailbox make one recipient
+    for (int i = 0; i < recipients_count; i++) {
+        if (!strcmp(recipients_address[i], rcpt)) {
+            free((void*)rcpt);
+            recipients_address[recipients_count] = 0;
+            return 250;
+        }
     }
     
     recipients_count++;
@@ -641,16 +688,9 @@ int SMTPProtocolServerSession::MessageDataEnd()
         if (!authenticated || strcmp(username, sender_address))
             return 550;
     } else {
-        bool only_far_recipients = 1;
-        for (int i = 0; i < recipients_count; i++) {
-            atpos = FindAtSymbolInAddress(recipients_address[i]);
-            if (!strcmp(recipients_address[i] + atpos + 1, domain)) {
-                only_far_recipients = 0;
-                break;
-            }
-        }
-        
-        if (only_far_recipients)
+        // a local alias may have been redirected to a remote address,
+        // it still is mail for this domain
+        if (!local_recipients)
             return 550;
     }
 
@@ -687,19 +727,36 @@ int SMTPProtocolServerSession::MessageDataEnd()
         header_parser.GetBody().Length()
     );
 
+    // spooled as it goes out, the index offsets follow the same bytes
+    InoutBuffer wire_data;
+    Message::MakeWireData(msg_data.GetBuffer(), msg_data.Length(), wire_data);
+
+    MimeIndex mime_index;
+    mime_index.Build(wire_data.GetBuffer(), wire_data.Length());
+
     Message *message = new Message(
         message_id,
         sender_address, 
         recipients_address, recipients_count, 
-        &msg_data
+        wire_data.GetBuffer(), wire_data.Length()
     );
 
-    if (mail_queue->AddMessage(message) < 0) {
+    if (message->GenerateMimeIndexFile(&mime_index) < 0) {
         write_log(
-            "[SMTP-DAEMON] %s message could not add to queue\n", 
+            "[SMTP-DAEMON] %s message MIME index could not be saved\n",
+            message_id
+        );
+    }
+
+    // the message is queued by the main loop once it is durable
+    pending_commit = spool_committer->Submit(message, this);
+    if (!pending_commit) {
+        write_log(
+            "[SMTP-DAEMON] %s message could not be spooled\n", 
             message_id
         );
 
+        message->DeleteMessage();
         delete message;
         delete [] message_id;   
 
@@ -707,7 +764,7 @@ int SMTPProtocolServerSession::MessageDataEnd()
     }
     delete [] message_id;
     
-    return 250;
+    return 0;
 }
 
 
@@ -4,6 +4,7 @@
 #include "buffer.h"
 #include "userlist.h"
 #include "mailqueue.h"
+#include "spoolcommit.h"
 
 
 class AbstractProtocolServerSession 
@@ -40,6 +41,7 @@ class SMTPProtocolServerSession : public AbstractProtocolServerSession
         st_beforemail,
         st_recipients,
         st_data,
+        st_committing,
         st_closed
     } state;
     
@@ -51,9 +53,14 @@ class SMTPProtocolServerSession : public AbstractProtocolServerSession
     
     int recipients_count, max_recipients_count;
     char **recipients_address, *sender_address;
+    //Some recipient was local before its redirects were followed
+    bool local_recipients;
     InoutBuffer msg_data;
     
     bool still_accepting_data;
+
+    //Spool record waiting for the group commit, reply is held back
+    SpoolCommitTicket *pending_commit;
         
 protected:
     const char *domain;
@@ -77,6 +84,10 @@ public:
     virtual void HandleNewData();
     virtual void RemoteEOT();
 
+            // called from the main loop once the spool record
+            // submitted by MessageDataEnd is durable (or failed)
+    void CommitDone(int code);
+
 
 protected:
     virtual void MessageDiscard();
@@ -106,6 +117,7 @@ protected:
 
             // [E]SMTP version
             // must return one of:
+            //      0   (reply deferred until CommitDone(...))
             //      250 (Ok), 
             //      451 (temporary failure)
             //      452 (quota exceeded)
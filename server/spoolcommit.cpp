@@ -0,0 +1,273 @@
+#include "spoolcommit.h"
+#include "mailqueue.h"
+#include "daemon.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+
+SpoolCommitter::SpoolCommitter(int a_commit_delay)
+{
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&cond, 0);
+    running = stopping = false;
+
+    pending_head = pending_last = 0;
+    done_head = done_last = 0;
+
+    notify_pipe[0] = notify_pipe[1] = -1;
+
+    commit_delay = a_commit_delay;
+}
+
+SpoolCommitter::~SpoolCommitter()
+{
+    Stop();
+
+    while (SpoolCommitTicket *ticket = Reap()) {
+        while (ticket) {
+            SpoolCommitTicket *next = ticket->next;
+            delete ticket;
+            ticket = next;
+        }
+    }
+
+    if (notify_pipe[0] >= 0)
+        close(notify_pipe[0]);
+    if (notify_pipe[1] >= 0)
+        close(notify_pipe[1]);
+
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+int SpoolCommitter::Start()
+{
+    if (pipe(notify_pipe) < 0) {
+        write_log(
+            "[SMTP-DAEMON] Can't create spool commit pipe\n(%s)\n",
+            strerror(errno)
+        );
+        return -1;
+    }
+    fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&thread, 0, ThreadFunc, this)) {
+        write_log("[SMTP-DAEMON] Can't start spool commit thread\n");
+        return -1;
+    }
+    running = true;
+
+    return 0;
+}
+
+void SpoolCommitter::Stop()
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    // pending tickets are still committed before the thread exits
+    pthread_join(thread, 0);
+    running = false;
+}
+
+int SpoolCommitter::GetNotifyFd() const { return notify_pipe[0]; }
+
+
+
+SpoolCommitTicket* SpoolCommitter::Submit(Message *message, void *owner)
+{
+    int fd = message->WriteTempSpoolFile();
+    if (fd < 0)
+        return 0;
+
+    SpoolCommitTicket *ticket = new SpoolCommitTicket;
+    ticket->message = message;
+    ticket->fd = fd;
+    ticket->owner = owner;
+    ticket->done = false;
+    ticket->status = -1;
+    ticket->next = 0;
+
+    pthread_mutex_lock(&mutex);
+    if (pending_last)
+        pending_last->next = ticket;
+    else
+        pending_head = ticket;
+    pending_last = ticket;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    return ticket;
+}
+
+SpoolCommitTicket* SpoolCommitter::Reap()
+{
+    if (notify_pipe[0] >= 0) {
+        char buf[64];
+        while (read(notify_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    pthread_mutex_lock(&mutex);
+    SpoolCommitTicket *list = done_head;
+    done_head = done_last = 0;
+    pthread_mutex_unlock(&mutex);
+
+    return list;
+}
+
+
+
+void* SpoolCommitter::ThreadFunc(void *arg)
+{
+    ((SpoolCommitter*)arg)->Run();
+    return 0;
+}
+
+void SpoolCommitter::Run()
+{
+    pthread_mutex_lock(&mutex);
+    for (;;) {
+        while (!pending_head && !stopping)
+            pthread_cond_wait(&cond, &mutex);
+
+        if (!pending_head && stopping)
+            break;
+
+        // give the other sessions of this loop iteration a chance
+        // to join the batch
+        if (commit_delay > 0 && !stopping) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+
+            struct timespec deadline;
+            long usec = now.tv_usec + commit_delay * 1000L;
+            deadline.tv_sec = now.tv_sec + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+
+            while (!stopping &&
+                pthread_cond_timedwait(&cond, &mutex, &deadline) != ETIMEDOUT)
+                ;
+        }
+
+        SpoolCommitTicket *batch = pending_head;
+        pending_head = pending_last = 0;
+        pthread_mutex_unlock(&mutex);
+
+        CommitBatch(batch);
+
+        pthread_mutex_lock(&mutex);
+        SpoolCommitTicket *last = batch;
+        while (last->next)
+            last = last->next;
+
+        if (done_last)
+            done_last->next = batch;
+        else
+            done_head = batch;
+        done_last = last;
+
+        write(notify_pipe[1], "c", 1);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void SpoolCommitter::CommitBatch(SpoolCommitTicket *batch)
+{
+    int count = 0;
+    for (SpoolCommitTicket *ticket = batch; ticket; ticket = ticket->next)
+        count++;
+
+    // the bucket directories the batch renamed into, each is synced
+    // once however many of the files went there
+    char **dirs = new char* [count];
+    int *ticket_dirs = new int [count];
+    int dir_count = 0;
+
+    int idx = 0;
+    for (SpoolCommitTicket *ticket = batch; ticket; ticket = ticket->next) {
+        const char *spool_path = ticket->message->GetSpoolPath();
+        char *tmp_path = new char [strlen(spool_path) + 5];
+        sprintf(tmp_path, "%s.tmp", spool_path);
+
+        ticket_dirs[idx] = -1;
+        if (fdatasync(ticket->fd) < 0) {
+            write_log(
+                "[SMTP-DAEMON] Spool fdatasync failed\n(%s)\n",
+                strerror(errno)
+            );
+            remove(tmp_path);
+            ticket->status = -1;
+        } else if (rename(tmp_path, spool_path) < 0) {
+            remove(tmp_path);
+            ticket->status = -1;
+        } else {
+            ticket->status = 0;
+
+            int len = strrchr(spool_path, '/') - spool_path;
+            int dir = 0;
+            while (dir < dir_count &&
+                (strncmp(dirs[dir], spool_path, len) || dirs[dir][len]))
+                dir++;
+            if (dir == dir_count) {
+                dirs[dir] = new char [len + 1];
+                memcpy(dirs[dir], spool_path, len);
+                dirs[dir][len] = '\0';
+                dir_count++;
+            }
+            ticket_dirs[idx] = dir;
+        }
+        delete [] tmp_path;
+        idx++;
+    }
+
+    for (int dir = 0; dir < dir_count; dir++) {
+        int dir_fd = open(dirs[dir], O_RDONLY);
+        bool synced = dir_fd >= 0 && fsync(dir_fd) == 0;
+        if (!synced) {
+            write_log(
+                "[SMTP-DAEMON] Spool directory %s fsync failed\n(%s)\n",
+                dirs[dir],
+                strerror(errno)
+            );
+        }
+        if (dir_fd >= 0)
+            close(dir_fd);
+
+        // the renames into it may not survive a crash
+        if (!synced) {
+            idx = 0;
+            for (SpoolCommitTicket *t = batch; t; t = t->next, idx++) {
+                if (ticket_dirs[idx] == dir)
+                    t->status = -1;
+            }
+        }
+        delete [] dirs[dir];
+    }
+    delete [] dirs;
+    delete [] ticket_dirs;
+
+    for (SpoolCommitTicket *ticket = batch; ticket; ticket = ticket->next) {
+        close(ticket->fd);
+        ticket->fd = -1;
+        ticket->done = true;
+    }
+
+    if (count > 1) {
+        write_log(
+            "[SMTP-DAEMON] Spool group commit of %d messages\n",
+            count
+        );
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef SPOOLCOMMIT_H_SENTRY
+#define SPOOLCOMMIT_H_SENTRY
+
+#include <pthread.h>
+
+class Message;
+
+struct SpoolCommitTicket
+{
+    Message *message;
+    int fd;
+
+    //Whoever waits for the result (the SMTP session), main thread only
+    void *owner;
+
+    bool done;
+    int status;
+
+    SpoolCommitTicket *next;
+};
+
+// Sessions that finish DATA within the same commit window are committed
+// together: each temporary file is fdatasync'ed and renamed into place,
+// then every bucket directory the batch went to is synced once. The
+// worker thread never touches the queue or the sessions, finished
+// tickets are handed back to the main loop through Reap().
+class SpoolCommitter
+{
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running, stopping;
+
+    SpoolCommitTicket *pending_head, *pending_last;
+    SpoolCommitTicket *done_head, *done_last;
+
+    //Written by the worker after each batch, watched by select()
+    int notify_pipe[2];
+
+    int commit_delay;
+
+public:
+    SpoolCommitter(int a_commit_delay);
+    ~SpoolCommitter();
+
+    int Start();
+    void Stop();
+
+    int GetNotifyFd() const;
+
+    //The message spool record is written to the temporary file here,
+    //0 is returned if it could not be written
+    SpoolCommitTicket* Submit(Message *message, void *owner);
+
+    //Finished tickets in submit order, the caller deletes them
+    SpoolCommitTicket* Reap();
+
+private:
+    static void* ThreadFunc(void *arg);
+    void Run();
+    void CommitBatch(SpoolCommitTicket *batch);
+};
+
+extern SpoolCommitter *spool_committer;
+
+#endif
@@ -1,4 +1,5 @@
 #include "userlist.h"
+#include "hash.h"
 
 #include "iniparser/iniparser.h"
 #include "daemon.h"
@@ -17,6 +18,7 @@ UserListElem::UserListElem(
     address = strdup(an_address);
     password = strdup(a_password);
     redirect_path = a_redirect_path ? strdup(a_redirect_path): 0;
+    final_address = address;
     
     const char *mail_prefix = server_options.mail_dir;
     int mail_prefix_len = strlen(mail_prefix);
@@ -30,6 +32,8 @@ UserListElem::UserListElem(
     path_to_mail[mail_prefix_len + address_len] = '\0';
 
     next = prev = 0;
+    hash_next = 0;
+    idx = -1;
 }
 
 UserListElem::~UserListElem() 
@@ -52,6 +56,10 @@ UserList::UserList()
 {
     head = last = 0;
     size = 0;
+
+    elems = 0;
+    max_size = 0;
+    memset(buckets, 0, sizeof(buckets));
 }
 
 UserList::~UserList()
@@ -64,6 +72,8 @@ UserList::~UserList()
             elem = next_elem;
         }
     }
+    if (elems)
+        delete [] elems;
 }
 //-----
 int UserList::AddElement(
@@ -81,6 +91,23 @@ int UserList::AddElement(
         last->next->prev = last;
         last = last->next;
     }
+
+    if (size == max_size) {
+        max_size = max_size ? 2 * max_size: 64;
+        UserListElem **new_elems = new UserListElem* [max_size];
+        if (elems) {
+            memcpy(new_elems, elems, size * sizeof(UserListElem*));
+            delete [] elems;
+        }
+        elems = new_elems;
+    }
+    elems[size] = last;
+    last->idx = size;
+
+    unsigned int bucket = Hash(an_address);
+    last->hash_next = buckets[bucket];
+    buckets[bucket] = last;
+
     return ++size;
 }
 
@@ -117,18 +144,22 @@ const char* UserList::GetPathToMail(int idx) const
     return GetUserListElem(idx)->path_to_mail;
 }
 
+const char* UserList::GetFinalAddress(int idx) const 
+{
+    if ((idx < 0) || (idx >= size))
+        return 0;
+    
+    return GetUserListElem(idx)->final_address;
+}
+
 bool UserList::IsEmpty() const { return !size; }
 
 int UserList::GetSize() const { return size; }
 
 int UserList::FindUserByAddress(const char *address) const 
 {
-    int idx = 0;
-    for (UserListElem *cur = head; cur; cur = cur->next, idx++) {
-        if (!strcmp(cur->address, address))
-            return idx;
-    }
-    return -1;
+    UserListElem *elem = FindElem(address);
+    return elem ? elem->idx: -1;
 }
 
 bool UserList::VerifyPassword(int idx, const char *password) const 
@@ -205,6 +236,8 @@ int UserList::Load(const char *users_file, const char *params_file)
         delete [] address;
     }
 
+    ResolveRedirects();
+
     write_log("[SMTP-DAEMON] USERLIST: done\n");
 
     fclose(f_users);
@@ -318,12 +351,53 @@ const UserListElem* UserList::GetUserListElem(int idx) const
     if ((idx < 0) || (idx >= size))
         return 0;
     
-    UserListElem *elem = head;
-    for (int i = 0; i < idx; i++, elem = elem->next);
-    
+    return elems[idx];
+}
+
+UserListElem* UserList::FindElem(const char *address) const
+{
+    UserListElem *elem = buckets[Hash(address)];
+    while (elem && strcmp(elem->address, address))
+        elem = elem->hash_next;
     return elem;
 }
 
+void UserList::ResolveRedirects()
+{
+    for (UserListElem *elem = head; elem; elem = elem->next) {
+        UserListElem *cur = elem;
+        int steps = 0;
+
+        // a chain longer than the list has to go round in a cycle
+        while (cur->redirect_path && steps <= size) {
+            UserListElem *target = FindElem(cur->redirect_path);
+            if (!target)
+                break;
+            cur = target;
+            steps++;
+        }
+
+        if (steps > size) {
+            write_log(
+                "[SMTP-DAEMON] USERLIST: redirect of %s goes round in a cycle, "
+                "its mail is kept locally\n",
+                elem->address
+            );
+            elem->final_address = elem->address;
+        } else if (cur->redirect_path) {
+            // a remote address or one nobody here has
+            elem->final_address = cur->redirect_path;
+        } else {
+            elem->final_address = cur->address;
+        }
+    }
+}
+
+unsigned int UserList::Hash(const char *address)
+{
+    return hash_string(address) % K_BUCKET_COUNT;
+}
+
 
 char* UserList::IncreaseBuffer(char *buf, int len, int &max_len) { 
     max_len *= 2;
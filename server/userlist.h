@@ -8,8 +8,14 @@ struct UserListElem
     char *address, *password;
     char *redirect_path;
     char *path_to_mail;
+    //Where the mail ends up once every redirect is followed, the own
+    //address if there is none (points into the list or at a
+    //redirect_path, nothing to free)
+    const char *final_address;
     
     UserListElem *next, *prev;
+    UserListElem *hash_next;
+    int idx;
     
     UserListElem(
         const char *an_address,
@@ -20,9 +26,18 @@ struct UserListElem
     
 };
 
+// Users are also kept in an array by index and in an address hash,
+// the redirects are flattened once the list is loaded.
 class UserList 
 {
+    enum {
+        K_BUCKET_COUNT = 1024
+    };
+
     UserListElem *head, *last;
+    UserListElem **elems;
+    int max_size;
+    UserListElem *buckets[K_BUCKET_COUNT];
 
     int size;
 public:
@@ -39,6 +54,7 @@ public:
     const char* GetPassword(int idx) const;
     const char* GetRedirectPath(int idx) const;
     const char* GetPathToMail(int idx) const;
+    const char* GetFinalAddress(int idx) const;
     
     int FindUserByAddress(const char *address) const;
     bool VerifyPassword(int idx, const char *password) const;
@@ -50,6 +66,11 @@ public:
     int Save(const char *users_file, const char *params_file);
 private:
     const UserListElem* GetUserListElem(int idx) const;
+    UserListElem* FindElem(const char *address) const;
+    //Follows the redirect chains, users caught in a cycle keep
+    //their own mailbox
+    void ResolveRedirects();
+    static unsigned int Hash(const char *address);
     static char* IncreaseBuffer(char *buf, int len, int &max_len);
     static char* ReadLineFromFile(FILE *f);
 };
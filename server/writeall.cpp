@@ -0,0 +1,30 @@
+#include "writeall.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+int write_all(int fd, const iovec *iov, int iov_count)
+{
+    // bytes of the first piece already written
+    size_t skip = 0;
+    while (iov_count > 0) {
+        ssize_t written = skip ?
+            write(fd, (const char*)iov->iov_base + skip, iov->iov_len - skip):
+            writev(fd, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        written += skip;
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        skip = written;
+    }
+
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef WRITEALL_H_SENTRY
+#define WRITEALL_H_SENTRY
+
+#include <sys/uio.h>
+
+//One writev() as long as it writes everything, a short write goes on
+//from where it stopped; iov is left as it is, -1 on failure
+int write_all(int fd, const iovec *iov, int iov_count);
+
+#endif